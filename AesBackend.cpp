@@ -0,0 +1,130 @@
+#include "AesBackend.h"
+#include <limits>
+#include "openssl/aes.h"
+#include "openssl/evp.h"
+
+static const quint8 CryptKeyText[16] = { 'b', 'n', 's', '_', 'o', 'b', 't', '_', 'k', 'r', '_', '2', '0', '1', '4', '#' };
+
+// The low level AES_encrypt/AES_decrypt interface, one block per call.
+class LegacyAesBackend : public AesBackend
+{
+public:
+	LegacyAesBackend()
+	{
+		AES_set_encrypt_key(CryptKeyText, sizeof(CryptKeyText) * 8, &encryptKey);
+		AES_set_decrypt_key(CryptKeyText, sizeof(CryptKeyText) * 8, &decryptKey);
+	}
+
+	const char * name() const override
+	{
+		return "legacy";
+	}
+
+	void encrypt(const uchar * in, uchar * out, qint64 size) const override
+	{
+		for (qint64 i = 0; i < size; i += AES_BLOCK_SIZE)
+			AES_encrypt(in + i, out + i, &encryptKey);
+	}
+
+	void decrypt(const uchar * in, uchar * out, qint64 size) const override
+	{
+		for (qint64 i = 0; i < size; i += AES_BLOCK_SIZE)
+			AES_decrypt(in + i, out + i, &decryptKey);
+	}
+
+private:
+	AES_KEY encryptKey;
+	AES_KEY decryptKey;
+};
+
+// EVP hands whole buffers to OpenSSL, which picks its pipelined AES-NI/VAES code at runtime
+// when the CPU supports it. Cipher contexts are stateful, so every thread keeps its own pair.
+class EvpAesBackend : public AesBackend
+{
+public:
+	const char * name() const override
+	{
+		return "evp";
+	}
+
+	void encrypt(const uchar * in, uchar * out, qint64 size) const override
+	{
+		run(threadContexts().encryptContext, in, out, size);
+	}
+
+	void decrypt(const uchar * in, uchar * out, qint64 size) const override
+	{
+		run(threadContexts().decryptContext, in, out, size);
+	}
+
+private:
+	struct ThreadContexts
+	{
+		EVP_CIPHER_CTX * encryptContext;
+		EVP_CIPHER_CTX * decryptContext;
+
+		ThreadContexts()
+		{
+			encryptContext = createContext(1);
+			decryptContext = createContext(0);
+		}
+
+		~ThreadContexts()
+		{
+			EVP_CIPHER_CTX_free(encryptContext);
+			EVP_CIPHER_CTX_free(decryptContext);
+		}
+	};
+
+	static EVP_CIPHER_CTX * createContext(int isEncrypt)
+	{
+		EVP_CIPHER_CTX * context = EVP_CIPHER_CTX_new();
+		EVP_CipherInit_ex(context, EVP_aes_128_ecb(), nullptr, CryptKeyText, nullptr, isEncrypt);
+		EVP_CIPHER_CTX_set_padding(context, 0);
+		return context;
+	}
+
+	static ThreadContexts & threadContexts()
+	{
+		thread_local ThreadContexts contexts;
+		return contexts;
+	}
+
+	static void run(EVP_CIPHER_CTX * context, const uchar * in, uchar * out, qint64 size)
+	{
+		// EVP_CipherUpdate takes an int length
+		const qint64 maxChunkSize = (std::numeric_limits<int>::max() / AES_BLOCK_SIZE) * AES_BLOCK_SIZE;
+		for (qint64 offset = 0; offset < size; offset += maxChunkSize)
+		{
+			int outLength = 0;
+			EVP_CipherUpdate(context, out + offset, &outLength, in + offset, (int)qMin(maxChunkSize, size - offset));
+		}
+	}
+};
+
+static LegacyAesBackend legacyBackend;
+static EvpAesBackend evpBackend;
+static AesBackend * currentBackend = &evpBackend;
+
+QList<AesBackend *> AesBackend::availableBackends()
+{
+	return QList<AesBackend *>() << &evpBackend << &legacyBackend;
+}
+
+AesBackend * AesBackend::current()
+{
+	return currentBackend;
+}
+
+bool AesBackend::select(const QString & name)
+{
+	for (AesBackend * backend : availableBackends())
+	{
+		if (name == backend->name())
+		{
+			currentBackend = backend;
+			return true;
+		}
+	}
+	return false;
+}
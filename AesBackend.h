@@ -0,0 +1,20 @@
+#pragma once
+#include <QtGlobal>
+#include <QList>
+#include <QString>
+
+// AES-128-ECB over whole buffers with the dat key. Sizes are multiples of 16 bytes,
+// in and out may point to the same buffer but must not overlap otherwise.
+class AesBackend
+{
+public:
+	virtual ~AesBackend() {}
+
+	virtual const char * name() const = 0;
+	virtual void encrypt(const uchar * in, uchar * out, qint64 size) const = 0;
+	virtual void decrypt(const uchar * in, uchar * out, qint64 size) const = 0;
+
+	static QList<AesBackend *> availableBackends();
+	static AesBackend * current();
+	static bool select(const QString & name);
+};
@@ -0,0 +1,70 @@
+#include "AsyncFileWriter.h"
+#include <QFile>
+#include "Stats.h"
+#include "Util.h"
+
+AsyncFileWriter::AsyncFileWriter(qint64 maxQueuedSize)
+	: maxQueuedSize(maxQueuedSize), queuedSize(0), isFinishing(false), failedCount(0), thread(this)
+{
+	thread.start();
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	finish();
+}
+
+void AsyncFileWriter::write(const QString & filePath, const QByteArray & data)
+{
+	QMutexLocker locker(&mutex);
+	// a file larger than the whole queue is still accepted once the queue has drained
+	while (!queue.isEmpty() && queuedSize + data.size() > maxQueuedSize)
+		queueNotFull.wait(&mutex);
+
+	const Job job = { filePath, data };
+	queue.enqueue(job);
+	queuedSize += data.size();
+	queueNotEmpty.wakeOne();
+}
+
+int AsyncFileWriter::finish()
+{
+	{
+		QMutexLocker locker(&mutex);
+		isFinishing = true;
+		queueNotEmpty.wakeOne();
+	}
+	thread.wait();
+	return failedCount;
+}
+
+void AsyncFileWriter::run()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			QMutexLocker locker(&mutex);
+			while (queue.isEmpty() && !isFinishing)
+				queueNotEmpty.wait(&mutex);
+			if (queue.isEmpty())
+				return;
+			job = queue.dequeue();
+		}
+
+		{
+			StatsTimer statsTimer(Stats::ExtractWriteStage, job.data.size());
+			QFile file(job.filePath);
+			if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(job.data) != job.data.size())
+			{
+				printLine(QString("Warning! file %1 write failed").arg(job.filePath));
+				failedCount++;
+			}
+		}
+
+		// the size is only released once the data is written, so the queue bounds the memory in flight
+		QMutexLocker locker(&mutex);
+		queuedSize -= job.data.size();
+		queueNotFull.wakeAll();
+	}
+}
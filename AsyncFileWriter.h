@@ -0,0 +1,59 @@
+#pragma once
+#include <QByteArray>
+#include <QMutex>
+#include <QQueue>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+// Creates and writes files on a dedicated thread, so callers never wait for file system metadata
+// operations. The queue is bounded by size, write() blocks while it is full.
+class AsyncFileWriter
+{
+public:
+	explicit AsyncFileWriter(qint64 maxQueuedSize = 64 * 1024 * 1024);
+	~AsyncFileWriter();
+
+	// data has to stay valid until finish() returns if it is raw data over a file mapping
+	void write(const QString & filePath, const QByteArray & data);
+
+	// Waits until every queued file is written and stops the thread. Returns the number of files that failed.
+	int finish();
+
+private:
+	struct Job
+	{
+		QString filePath;
+		QByteArray data;
+	};
+
+	class WriterThread : public QThread
+	{
+	public:
+		explicit WriterThread(AsyncFileWriter * writer)
+			: writer(writer)
+		{
+		}
+
+	protected:
+		void run() override
+		{
+			writer->run();
+		}
+
+	private:
+		AsyncFileWriter * writer;
+	};
+
+	void run();
+
+	const qint64 maxQueuedSize;
+	QMutex mutex;
+	QWaitCondition queueNotEmpty;
+	QWaitCondition queueNotFull;
+	QQueue<Job> queue;
+	qint64 queuedSize;
+	bool isFinishing;
+	int failedCount;
+	WriterThread thread;
+};
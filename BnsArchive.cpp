@@ -0,0 +1,168 @@
+#include "BnsArchive.h"
+#include "BnsTool.h"
+#include "DatFormat.h"
+
+BnsArchive::BnsArchive()
+	: mappedFile(nullptr), fileSize(0), dataBeginPos(0), intSize(0)
+{
+}
+
+BnsArchive::~BnsArchive()
+{
+	close();
+}
+
+// A 64-bit header read as 32-bit puts the high half of the total size where fileCount belongs,
+// which fails the check, so 32-bit is tried first.
+static int detectIntSize(QFile * file)
+{
+	file->seek(0);
+	const QByteArray headerBytes = file->read(sizeof(DatFileHeader<8>));
+	if (headerBytes.size() >= (int)sizeof(DatFileHeader<4>))
+	{
+		DatFileHeader<4> header;
+		memcpy(&header, headerBytes.constData(), sizeof(header));
+		if (header.check() && (qint64)sizeof(header) + header.packedFileTableSize <= file->size())
+			return 4;
+	}
+	if (headerBytes.size() >= (int)sizeof(DatFileHeader<8>))
+	{
+		DatFileHeader<8> header;
+		memcpy(&header, headerBytes.constData(), sizeof(header));
+		if (header.check() && (qint64)sizeof(header) + header.packedFileTableSize <= file->size())
+			return 8;
+	}
+	return 0;
+}
+
+template <int intSize>
+bool BnsArchive::readTable()
+{
+	DatFileHeader<intSize> header;
+	QVector<DatFileEntry<intSize>> datEntries;
+	if (!readDatFile<intSize>(&file, header, dataBeginPos, datEntries))
+		return false;
+
+	entries.reserve(datEntries.size());
+	entryIndex.reserve(datEntries.size());
+	for (const DatFileEntry<intSize> & datEntry : datEntries)
+	{
+		const DatFileTableItem<intSize> & fileItem = datEntry.fileItem;
+		const Entry entry = { datEntry.relativeFilePath, fileItem.isCompressed, fileItem.isEncrypted,
+			fileItem.unpackedSize, fileItem.intermediateSize, fileItem.packedSize, fileItem.dataOffset };
+		entryIndex.insert(normalizeEntryPath(entry.path), entries.size());
+		entries.append(entry);
+	}
+	return true;
+}
+
+bool BnsArchive::open(const QString & fileName)
+{
+	close();
+	file.setFileName(fileName);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		printLine(QString("Error! file %1 open failed").arg(fileName));
+		return false;
+	}
+	fileSize = file.size();
+
+	intSize = detectIntSize(&file);
+	const bool isRead = (intSize == 4) ? readTable<4>() : (intSize == 8) ? readTable<8>() : false;
+	if (!isRead)
+	{
+		printLine(QString("Error! %1 is not a dat file").arg(fileName));
+		close();
+		return false;
+	}
+
+	// without a mapping, e.g. for multi-GB archives in a 32-bit process, reads take turns on the file
+	mappedFile = file.map(0, fileSize);
+	return true;
+}
+
+void BnsArchive::close()
+{
+	if (mappedFile)
+		file.unmap((uchar*)mappedFile);
+	mappedFile = nullptr;
+	file.close();
+	fileSize = 0;
+	dataBeginPos = 0;
+	intSize = 0;
+	entries.clear();
+	entryIndex.clear();
+}
+
+bool BnsArchive::isOpen() const
+{
+	return intSize != 0;
+}
+
+bool BnsArchive::is64() const
+{
+	return intSize == 8;
+}
+
+QString BnsArchive::fileName() const
+{
+	return file.fileName();
+}
+
+int BnsArchive::entryCount() const
+{
+	return entries.size();
+}
+
+const BnsArchive::Entry & BnsArchive::entry(int index) const
+{
+	return entries.at(index);
+}
+
+const BnsArchive::Entry * BnsArchive::entry(const QString & path) const
+{
+	const QHash<QString, int>::const_iterator it = entryIndex.constFind(normalizeEntryPath(path));
+	return (it != entryIndex.constEnd()) ? &entries.at(it.value()) : nullptr;
+}
+
+QByteArray BnsArchive::readPacked(const Entry & entry) const
+{
+	const qint64 dataPos = dataBeginPos + entry.dataOffset;
+	if (dataPos < 0 || entry.packedSize < 0 || dataPos + entry.packedSize > fileSize)
+	{
+		printLine(QString("Warning! file %1 lies outside the archive").arg(entry.path));
+		return QByteArray();
+	}
+	if (entry.packedSize > BnsTool::MaxEntrySize)
+	{
+		printLine(QString("Warning! file %1 of %2 bytes is too large to read").arg(entry.path).arg(entry.packedSize));
+		return QByteArray();
+	}
+	if (mappedFile)
+		return QByteArray::fromRawData((const char*)mappedFile + dataPos, (int)entry.packedSize);
+
+	QMutexLocker locker(&fileMutex);
+	file.seek(dataPos);
+	return file.read(entry.packedSize);
+}
+
+QByteArray BnsArchive::readUnpacked(const Entry & entry) const
+{
+	const QByteArray packedData = readPacked(entry);
+	// unpack hands plain entries back as they are, which would be raw data over the mapping
+	if (!entry.isCompressed && !entry.isEncrypted)
+		return QByteArray(packedData.constData(), packedData.size());
+	return BnsTool::unpack(packedData, entry.unpackedSize, entry.isEncrypted, entry.isCompressed);
+}
+
+QByteArray BnsArchive::readPacked(const QString & path) const
+{
+	const Entry * foundEntry = entry(path);
+	return foundEntry ? readPacked(*foundEntry) : QByteArray();
+}
+
+QByteArray BnsArchive::readUnpacked(const QString & path) const
+{
+	const Entry * foundEntry = entry(path);
+	return foundEntry ? readUnpacked(*foundEntry) : QByteArray();
+}
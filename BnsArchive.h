@@ -0,0 +1,63 @@
+#pragma once
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+// A dat file opened once for any number of lookups. The header and file table are decoded by open(),
+// entry data is only read and unpacked when asked for. After open() every const member may be called
+// from several threads at once.
+class BnsArchive
+{
+public:
+	struct Entry
+	{
+		QString path;
+		bool isCompressed;
+		bool isEncrypted;
+		qint64 unpackedSize;
+		qint64 intermediateSize;
+		qint64 packedSize;
+		qint64 dataOffset;
+	};
+
+	BnsArchive();
+	~BnsArchive();
+
+	// Detects whether the file is a 32-bit or 64-bit dat from its header.
+	bool open(const QString & fileName);
+	void close();
+
+	bool isOpen() const;
+	bool is64() const;
+	QString fileName() const;
+
+	int entryCount() const;
+	const Entry & entry(int index) const;
+	// path is matched ignoring case, with / and \ alike. Returns nullptr if there is no such entry.
+	const Entry * entry(const QString & path) const;
+
+	// Packed data may point straight into a mapping of the file and is only valid while the archive is open.
+	QByteArray readPacked(const Entry & entry) const;
+	QByteArray readUnpacked(const Entry & entry) const;
+	QByteArray readPacked(const QString & path) const;
+	QByteArray readUnpacked(const QString & path) const;
+
+private:
+	Q_DISABLE_COPY(BnsArchive)
+
+	template <int intSize>
+	bool readTable();
+
+	mutable QFile file;
+	// only guards reads through file, the mapping needs no lock
+	mutable QMutex fileMutex;
+	const uchar * mappedFile;
+	qint64 fileSize;
+	qint64 dataBeginPos;
+	int intSize;
+	QVector<Entry> entries;
+	QHash<QString, int> entryIndex;
+};
@@ -1,648 +1,2492 @@
 #include "BnsTool.h"
 #include <QtEndian>
+#include <QAtomicInt>
 #include <QBuffer>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMutex>
+#include <QRegExp>
+#include <QSaveFile>
+#include <QScopedPointer>
+#include <QSet>
 #include <QtDebug>
-#include <QDomDocument>
+#include <QXmlStreamReader>
+#include <limits>
 #include "openssl/aes.h"
+#ifdef Q_OS_WIN
+#include <QtZlib/zlib.h>
+#else
+#include <zlib.h>
+#endif
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include "AesBackend.h"
+#include "AsyncFileWriter.h"
+#include "BnsArchive.h"
+#include "DatFormat.h"
+#include "PackCache.h"
+#include "Stats.h"
+#include "TarStream.h"
 #include "Util.h"
+#include "XmlPatch.h"
+#include "XorCodec.h"
 
-static const quint8 CryptKeyText[16] = { 'b', 'n', 's', '_', 'o', 'b', 't', '_', 'k', 'r', '_', '2', '0', '1', '4', '#' };
+template <int intSize>
+struct ExtractTask
+{
+	const DatFileEntry<intSize> * entry;
+	int index;
+	QByteArray data;
+};
+
+// Returns the indexes of the entries matching any of patterns in table order, or all entries if there are no patterns.
+// Plain paths are looked up in a path index, patterns with wildcards are matched against every path.
+template <int intSize>
+static QVector<int> selectEntries(const QVector<DatFileEntry<intSize>> & entries, const QStringList & patterns)
+{
+	QVector<int> selectedIndexes;
+	if (patterns.isEmpty())
+	{
+		selectedIndexes.reserve(entries.size());
+		for (int i = 0; i < entries.size(); ++i)
+			selectedIndexes.append(i);
+		return selectedIndexes;
+	}
+
+	QHash<QString, int> pathIndex;
+	pathIndex.reserve(entries.size());
+	for (int i = 0; i < entries.size(); ++i)
+		pathIndex.insert(normalizeEntryPath(entries.at(i).relativeFilePath), i);
+
+	QVector<bool> isSelected(entries.size(), false);
+	for (const QString & pattern : patterns)
+	{
+		const QString normalizedPattern = normalizeEntryPath(pattern);
+		bool isMatched = false;
+		if (normalizedPattern.contains('*') || normalizedPattern.contains('?') || normalizedPattern.contains('['))
+		{
+			const QRegExp regExp(normalizedPattern, Qt::CaseSensitive, QRegExp::Wildcard);
+			for (QHash<QString, int>::const_iterator it = pathIndex.constBegin(); it != pathIndex.constEnd(); ++it)
+			{
+				if (regExp.exactMatch(it.key()))
+				{
+					isSelected[it.value()] = true;
+					isMatched = true;
+				}
+			}
+		}
+		else
+		{
+			const QHash<QString, int>::const_iterator it = pathIndex.constFind(normalizedPattern);
+			if (it != pathIndex.constEnd())
+			{
+				isSelected[it.value()] = true;
+				isMatched = true;
+			}
+		}
+		if (!isMatched)
+			printLine(QString("Warning! %1 matches no file").arg(pattern));
+	}
+
+	for (int i = 0; i < entries.size(); ++i)
+	{
+		if (isSelected.at(i))
+			selectedIndexes.append(i);
+	}
+	return selectedIndexes;
+}
+
+// 32-bit and 64-bit archives are told apart by BnsArchive, so -l and -l64 behave the same
+static bool list(QFile * inFile)
+{
+	if (!inFile)
+		return false;
+
+	BnsArchive archive;
+	if (!archive.open(inFile->fileName()))
+		return false;
+
+	qint64 totalUnpackedSize = 0;
+	qint64 totalPackedSize = 0;
+	for (int i = 0; i < archive.entryCount(); ++i)
+	{
+		const BnsArchive::Entry & entry = archive.entry(i);
+		const QString flags = QString("%1%2").arg(entry.isCompressed ? 'C' : '-').arg(entry.isEncrypted ? 'E' : '-');
+		printLine(QString("%1 %2 %3  %4").arg(entry.unpackedSize, 12).arg(entry.packedSize, 12).arg(flags).arg(entry.path));
+		totalUnpackedSize += entry.unpackedSize;
+		totalPackedSize += entry.packedSize;
+	}
+	printLine(QString("%1-bit archive, %2 files, %3 bytes unpacked, %4 bytes packed").arg(archive.is64() ? 64 : 32)
+		.arg(archive.entryCount()).arg(totalUnpackedSize).arg(totalPackedSize));
+	return true;
+}
+
+template <int intSize>
+bool extract(QFile * inFile, QDir outDir, const BnsTool::ExtractOptions & options)
+{
+	if (!inFile)
+		return false;
+	printLine(QString("Extracting %1 to %2").arg(inFile->fileName()).arg(options.tarOutput ? QString("tar stream") : outDir.path()));
+
+	DatFileHeader<intSize> header;
+	qint64 dataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> entries;
+	if (!readDatFile<intSize>(inFile, header, dataBeginPos, entries))
+		return false;
+
+	if (!options.tarOutput && !outDir.exists())
+		outDir.mkdir(".");
+
+	const QVector<int> selectedIndexes = selectEntries<intSize>(entries, options.onlyPatterns);
+
+	// every directory is created once up front instead of checking it for every file
+	if (!options.tarOutput)
+	{
+		StatsTimer statsTimer(Stats::ExtractMkdirStage);
+		QSet<QString> relativeDirPaths;
+		for (const int index : selectedIndexes)
+		{
+			const QString relativeFilePath = QString(entries.at(index).relativeFilePath).replace('\\', '/');
+			const int separatorIndex = relativeFilePath.lastIndexOf('/');
+			if (separatorIndex > 0)
+				relativeDirPaths.insert(relativeFilePath.left(separatorIndex));
+		}
+		for (const QString & relativeDirPath : relativeDirPaths)
+		{
+			if (!outDir.mkpath(relativeDirPath))
+				printLine(QString("Warning! dir %1 create failed").arg(relativeDirPath));
+		}
+	}
+
+	// Mapped input lets unpack decrypt straight out of the page cache without a read() and a copy per entry.
+	// Files that cannot be mapped, e.g. multi-GB archives in a 32-bit process, fall back to seek and read.
+	const qint64 inFileSize = inFile->size();
+	uchar * mappedInFile = options.useFileMapping ? inFile->map(0, inFileSize) : nullptr;
+
+	qint64 actualTotalFileIntermediateSize = 0;
+	for (const DatFileEntry<intSize> & entry : entries)
+		actualTotalFileIntermediateSize += entry.fileItem.intermediateSize;
+
+	int nextSelectedIndex = 0;
+	int invalidFileCount = 0;
+
+	// Entries are read and written in table order on this thread, only unpack and xml conversion run in parallel.
+	auto prepare = [&](ExtractTask<intSize> & task) -> bool
+	{
+		while (nextSelectedIndex < selectedIndexes.size())
+		{
+			task.index = nextSelectedIndex++;
+			task.entry = &entries.at(selectedIndexes.at(task.index));
+
+			const DatFileTableItem<intSize> & fileItem = task.entry->fileItem;
+			const qint64 dataPos = dataBeginPos + fileItem.dataOffset;
+			// packedSize is a qintX from the table, an entry larger than one QByteArray can hold is skipped
+			if (dataPos < 0 || fileItem.packedSize < 0 || fileItem.packedSize > BnsTool::MaxEntrySize)
+			{
+				printLine(QString("Error! file %1 has an invalid packed size or offset").arg(task.entry->relativeFilePath));
+				invalidFileCount++;
+				continue;
+			}
+
+			StatsTimer statsTimer(Stats::ExtractReadStage, fileItem.packedSize);
+			if (mappedInFile && dataPos + fileItem.packedSize <= inFileSize)
+			{
+				task.data = QByteArray::fromRawData((const char*)mappedInFile + dataPos, (int)fileItem.packedSize);
+			}
+			else
+			{
+				inFile->seek(dataPos);
+				task.data = inFile->read(fileItem.packedSize);
+			}
+			return true;
+		}
+		return false;
+	};
+
+	auto process = [&options](ExtractTask<intSize> & task)
+	{
+		QElapsedTimer entryTimer;
+		if (Stats::isEnabled())
+			entryTimer.start();
+
+		const DatFileTableItem<intSize> & fileItem = task.entry->fileItem;
+		task.data = BnsTool::unpack(task.data, fileItem.unpackedSize, fileItem.isEncrypted, fileItem.isCompressed);
+
+		if (options.convertXml && task.entry->relativeFilePath.endsWith(".xml", Qt::CaseInsensitive) && task.data.startsWith("LMXBOSLB"))
+		{
+			// keep the binary xml if it cannot be converted rather than writing an empty file
+			QByteArray textXml = BnsTool::xmlBin2Text(task.data);
+			if (textXml.size() > 0)
+				task.data = textXml;
+			else
+				printLine(QString("Warning! file %1 convert failed").arg(task.entry->relativeFilePath));
+		}
+
+		if (Stats::isEnabled())
+			Stats::addEntry(task.entry->relativeFilePath, entryTimer.nsecsElapsed(), fileItem.unpackedSize);
+	};
+
+	// files are created and written on the writer thread, finish only waits when its queue is full.
+	// Tar output is written in order by finish itself, so the writer thread is only started for a directory.
+	QScopedPointer<AsyncFileWriter> fileWriter(options.tarOutput ? nullptr : new AsyncFileWriter());
+	QScopedPointer<TarWriter> tarWriter(options.tarOutput ? new TarWriter(options.tarOutput) : nullptr);
+	int failedTarFileCount = 0;
+
+	auto finish = [&](ExtractTask<intSize> & task)
+	{
+		const QString & relativeFilePath = task.entry->relativeFilePath;
+		printLine(QString("%1 / %2  %3").arg(task.index + 1).arg(selectedIndexes.size()).arg(relativeFilePath));
+
+		if (tarWriter)
+		{
+			StatsTimer statsTimer(Stats::ExtractWriteStage, task.data.size());
+			if (!tarWriter->writeFile(QString(relativeFilePath).replace('\\', '/'), task.data))
+				failedTarFileCount++;
+		}
+		else
+		{
+			fileWriter->write(outDir.filePath(QString(relativeFilePath).replace('\\', '/')), task.data);
+		}
+		task.data.clear();
+	};
+
+	const qint64 internHitsBefore = XorStringInternTable::totalHitCount();
+	const qint64 internMissesBefore = XorStringInternTable::totalMissCount();
+
+	const int threadCount = resolveThreadCount(options.threadCount);
+	runOrderedPipeline<ExtractTask<intSize>>(threadCount, threadCount * 4, prepare, process, finish);
+
+	// stored entries may still point into the mapping
+	const int failedFileCount = (fileWriter ? fileWriter->finish() : 0) + failedTarFileCount + invalidFileCount;
+	const bool isTarFinished = !tarWriter || tarWriter->finish();
+	if (!isTarFinished)
+		printLine("Error! tar stream write failed");
+	if (mappedInFile)
+		inFile->unmap(mappedInFile);
+	if (failedFileCount > 0)
+		printLine(QString("Warning! %1 files could not be written").arg(failedFileCount));
+
+	if(actualTotalFileIntermediateSize != header.totalFileIntermediateSize)
+		printLine(QString("Warning! error recorded sum size"));
+
+	if (options.convertXml)
+	{
+		const qint64 internHits = XorStringInternTable::totalHitCount() - internHitsBefore;
+		const qint64 internMisses = XorStringInternTable::totalMissCount() - internMissesBefore;
+		if (internHits + internMisses > 0)
+			printLine(QString("Xml names: %1 decoded, %2 reused (%3% hit rate)").arg(internMisses).arg(internHits)
+				.arg(100.0 * internHits / (internHits + internMisses), 0, 'f', 1));
+	}
+
+	printLine("Extract finished");
+
+	return failedFileCount == 0 && isTarFinished;
+}
+
+template <int intSize>
+struct CompressTask
+{
+	const ScannedFile * scannedFile;
+	int index;
+	QString relativeFilePath;
+	bool isOpened;
+	const DatFileEntry<intSize> * baseEntry;
+	bool isReused;
+	BnsTool::CompressionLevel compressionLevel;
+	// content read from a tar stream, scannedFile is null then
+	QByteArray fileData;
+	// set with --dedup, isDuplicate means another task packs the same content
+	QByteArray contentKey;
+	bool isDuplicate;
+	QByteArray packedFileData;
+	DatFileTableItem<intSize> fileItem;
+};
+
+// Picks the compression level for a file, overrides come first, then the file type defaults, then the global level.
+class CompressionPolicy
+{
+public:
+	explicit CompressionPolicy(const BnsTool::CompressOptions & options)
+		: defaultLevel(options.compressionLevel)
+	{
+		for (const QPair<QString, BnsTool::CompressionLevel> & levelOverride : options.compressionLevelOverrides)
+			addRule(levelOverride.first, levelOverride.second);
+
+		// media that is compressed already only costs time to deflate again
+		static const char * const StoredPatterns[] = { "*.png", "*.jpg", "*.jpeg", "*.ogg", "*.mp3", "*.bik", "*.zip", "*.gz" };
+		for (const char * pattern : StoredPatterns)
+			addRule(pattern, BnsTool::StoreLevel);
+	}
+
+	// not thread safe, QRegExp caches its matches
+	BnsTool::CompressionLevel levelFor(const QString & relativeFilePath)
+	{
+		const QString normalizedPath = normalizeEntryPath(relativeFilePath);
+		for (QPair<QRegExp, BnsTool::CompressionLevel> & rule : rules)
+		{
+			if (rule.first.exactMatch(normalizedPath))
+				return rule.second;
+		}
+		return defaultLevel;
+	}
+
+private:
+	void addRule(const QString & pattern, BnsTool::CompressionLevel level)
+	{
+		rules.append(qMakePair(QRegExp(normalizeEntryPath(pattern), Qt::CaseSensitive, QRegExp::Wildcard), level));
+	}
+
+	const BnsTool::CompressionLevel defaultLevel;
+	QVector<QPair<QRegExp, BnsTool::CompressionLevel>> rules;
+};
+
+// Checks whether fileData is what unpacking the base entry gives, or for text xml, what -x would have written for it.
+template <int intSize>
+static bool isSameAsBaseEntry(const QByteArray & fileData, bool isTextXml, const DatFileTableItem<intSize> & baseFileItem, const QByteArray & basePackedFileData)
+{
+	if (!isTextXml && fileData.size() != baseFileItem.unpackedSize)
+		return false;
+
+	const QByteArray baseFileData = BnsTool::unpack(basePackedFileData, baseFileItem.unpackedSize, baseFileItem.isEncrypted, baseFileItem.isCompressed);
+	if (baseFileData == fileData)
+		return true;
+	return isTextXml && baseFileData.startsWith("LMXBOSLB") && BnsTool::xmlBin2Text(baseFileData) == fileData;
+}
+
+
+static bool moveFileData(QFile * file, qint64 fromPos, qint64 toPos, qint64 size)
+{
+	// copy backwards so that moving towards the end never overwrites data that is yet to be moved
+	const qint64 chunkSize = 4 * 1024 * 1024;
+	qint64 remaining = size;
+	while (remaining > 0)
+	{
+		const qint64 length = qMin(chunkSize, remaining);
+		remaining -= length;
+		if (!file->seek(fromPos + remaining))
+			return false;
+		const QByteArray chunk = file->read(length);
+		if (chunk.size() != length || !file->seek(toPos + remaining) || file->write(chunk) != length)
+			return false;
+	}
+	return true;
+}
+
+// Lays out header, packed file table and data of a dat file.
+// In buffered mode the data region is kept in memory and the file is written in one go by finish().
+// In streaming mode entries go to outFile as soon as they are added, behind a region reserved for
+// the header and the packed file table, which finish() backpatches. If the reserved region turns
+// out to be too small the data region is moved to make room, otherwise the unused part of the
+// reserved region is left as a zero filled gap that dataBeginPos skips. The reservation is an
+// estimate rather than compressBound(), so the gap stays small at the rare cost of a move.
+template <int intSize>
+class DatWriter
+{
+public:
+	typedef typename QIntegerForSize<intSize>::Signed qintX;
+
+	DatWriter(QFile * outFile, bool isStreaming, qint64 maxUnpackedFileTableSize)
+		: outFile(outFile), isStreaming(isStreaming), dataSize(0), totalIntermediateSize(0), isFailed(false)
+	{
+		header.init();
+		header.isCompressed = true;
+		header.isEncrypted = true;
+
+		fileTableStream.open(QIODevice::WriteOnly);
+		if (isStreaming)
+		{
+			reservedDataBeginPos = sizeof(header) + estimatePackedFileTableSize(maxUnpackedFileTableSize) + intSize;
+			if (!outFile->seek(reservedDataBeginPos))
+				isFailed = true;
+		}
+		else
+		{
+			reservedDataBeginPos = 0;
+			fileDataStream.open(QIODevice::WriteOnly);
+		}
+	}
+
+	void addEntry(const QString & relativeFilePath, DatFileTableItem<intSize> & fileItem, const QByteArray & packedFileData)
+	{
+		// offsets and sums are qintX on disk, a 32-bit dat can not address data beyond 2 GB
+		const qint64 maxValue = std::numeric_limits<qintX>::max();
+		if (dataSize + packedFileData.size() > maxValue || totalIntermediateSize + fileItem.intermediateSize > maxValue)
+		{
+			if (!isFailed)
+				printLine(QString("Error! archive exceeds %1 bytes at %2, use -c64 for larger archives").arg(maxValue).arg(relativeFilePath));
+			isFailed = true;
+			return;
+		}
+		fileItem.dataOffset = dataSize;
+
+		if (isStreaming)
+		{
+			if (outFile->write(packedFileData) != packedFileData.size())
+				isFailed = true;
+		}
+		else
+		{
+			if (fileDataStream.write(packedFileData) != packedFileData.size())
+				isFailed = true;
+		}
+		dataSize += packedFileData.size();
+		addTableItem(relativeFilePath, fileItem);
+	}
+
+	// Adds an entry for data that an earlier entry wrote already, fileItem.dataOffset has to point at it.
+	void addSharedEntry(const QString & relativeFilePath, const DatFileTableItem<intSize> & fileItem)
+	{
+		if (totalIntermediateSize + fileItem.intermediateSize > std::numeric_limits<qintX>::max())
+		{
+			if (!isFailed)
+				printLine(QString("Error! archive exceeds %1 bytes at %2, use -c64 for larger archives").arg(std::numeric_limits<qintX>::max()).arg(relativeFilePath));
+			isFailed = true;
+			return;
+		}
+		addTableItem(relativeFilePath, fileItem);
+	}
+
+	bool finish()
+	{
+		StatsTimer statsTimer(Stats::TableWriteStage);
+		fileTableStream.close();
+
+		QByteArray fileTable = fileTableStream.data();
+		QByteArray packedFileTable = BnsTool::pack(fileTable, header.isEncrypted, header.isCompressed);
+
+		header.unpackedFileTableSize = fileTable.size();
+		header.packedFileTableSize = packedFileTable.size();
+
+		fileTable.clear();
+		fileTableStream.setData(QByteArray());
+
+		qintX dataBeginPos = (qintX)(sizeof(header) + packedFileTable.size() + intSize);
+		if (isStreaming)
+		{
+			if (dataBeginPos > reservedDataBeginPos)
+			{
+				printLine("Warning! reserved file table region too small, moving data");
+				if (!moveFileData(outFile, reservedDataBeginPos, dataBeginPos, dataSize))
+					isFailed = true;
+			}
+			else
+			{
+				dataBeginPos = (qintX)reservedDataBeginPos;
+			}
+			if (!outFile->seek(0))
+				isFailed = true;
+		}
+
+		if (outFile->write((const char*)&header, sizeof(header)) != sizeof(header)
+			|| outFile->write(packedFileTable) != packedFileTable.size()
+			|| !streamWrite<qintX>(outFile, dataBeginPos))
+			isFailed = true;
+
+		if (!isStreaming)
+		{
+			fileDataStream.close();
+			if (outFile->write(fileDataStream.buffer()) != fileDataStream.buffer().size())
+				isFailed = true;
+			fileDataStream.setData(QByteArray());
+		}
+
+		// a full disk may only show up once the buffered bytes reach the file
+		if (!outFile->flush() || outFile->size() < dataBeginPos + dataSize)
+			isFailed = true;
+
+		if (isFailed)
+			printLine("Error! writing data failed");
+		return !isFailed;
+	}
+
+private:
+	// Tables are mostly UTF-16 paths with long common prefixes and pack to well below half their size,
+	// the constant covers AES padding and tables too small to compress.
+	static qint64 estimatePackedFileTableSize(qint64 unpackedFileTableSize)
+	{
+		return getPaddedSize(unpackedFileTableSize / 2 + 4096, AES_BLOCK_SIZE);
+	}
+
+	void addTableItem(const QString & relativeFilePath, const DatFileTableItem<intSize> & fileItem)
+	{
+		streamAutoWriteString<intSize>(&fileTableStream, relativeFilePath, false);
+		fileTableStream.write((const char*)&fileItem, sizeof(fileItem));
+
+		totalIntermediateSize += fileItem.intermediateSize;
+		header.fileCount++;
+		header.totalFileIntermediateSize = totalIntermediateSize;
+	}
+
+	QFile * outFile;
+	const bool isStreaming;
+	DatFileHeader<intSize> header;
+	QBuffer fileTableStream;
+	QBuffer fileDataStream;
+	qint64 reservedDataBeginPos;
+	qint64 dataSize;
+	qint64 totalIntermediateSize;
+	bool isFailed;
+};
+
+template <int intSize>
+bool compress(QDir inDir, QFile * outFile, const BnsTool::CompressOptions & options)
+{
+	if (!outFile)
+		return false;
+	printLine(QString("Compressing %1 to %2").arg(options.tarInput ? QString("tar stream") : inDir.path()).arg(outFile->fileName()));
+
+	// Unchanged files are copied from the base dat as they are, so only edited and new files go through pack.
+	QFile baseFile(options.baseFileName);
+	DatFileHeader<intSize> baseHeader;
+	qint64 baseDataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> baseEntries;
+	QHash<QString, int> baseEntryIndex;
+	uchar * mappedBaseFile = nullptr;
+	if (!options.baseFileName.isEmpty())
+	{
+		const QString baseFilePath = QFileInfo(baseFile).canonicalFilePath();
+		if (!baseFilePath.isEmpty() && baseFilePath == QFileInfo(*outFile).canonicalFilePath())
+		{
+			printLine("Error! base file can not be the output file");
+			return false;
+		}
+		if (!readDatFile<intSize>(&baseFile, baseHeader, baseDataBeginPos, baseEntries))
+			return false;
+		baseEntryIndex.reserve(baseEntries.size());
+		for (int i = 0; i < baseEntries.size(); ++i)
+			baseEntryIndex.insert(normalizeEntryPath(baseEntries.at(i).relativeFilePath), i);
+		mappedBaseFile = baseFile.map(0, baseFile.size());
+	}
+	const qint64 baseFileSize = baseFile.isOpen() ? baseFile.size() : 0;
+
+	const QVector<ScannedFile> scannedFiles = options.tarInput ? QVector<ScannedFile>() : scanFiles(inDir, options.threadCount);
+
+	QStringList relativeFilePaths;
+	qint64 maxUnpackedFileTableSize = 0;
+	qint64 totalInputSize = 0;
+	for (const ScannedFile & scannedFile : scannedFiles)
+	{
+		const QString relativeFilePath = QString(scannedFile.relativeFilePath).replace("/", "\\");
+		relativeFilePaths << relativeFilePath;
+		maxUnpackedFileTableSize += intSize + relativeFilePath.length() * 2 + sizeof(DatFileTableItem<intSize>);
+		totalInputSize += scannedFile.size;
+	}
+
+	// The size of a tar stream is only known at its end, so it is always streamed. Only a small table is reserved
+	// to keep the gap in front of the data small, DatWriter moves the data once if the stream holds more entries.
+	const qint64 TarReservedEntryCount = 1024;
+	if (options.tarInput)
+		maxUnpackedFileTableSize = TarReservedEntryCount * (intSize + 64 * 2 + sizeof(DatFileTableItem<intSize>));
+
+	// the buffered data region is a single QByteArray, large inputs always go straight to the file
+	const qint64 AutoStreamInputSize = 1024 * 1024 * 1024;
+	const bool isStreaming = options.streamOutput || options.tarInput || totalInputSize > AutoStreamInputSize;
+	if (isStreaming && !options.streamOutput && !options.tarInput)
+		printLine(QString("Input is %1 bytes, streaming output").arg(totalInputSize));
+
+	// streaming mode may have to read back the data region if the reserved table region is too small
+	if (!outFile->isOpen())
+		outFile->open(isStreaming ? (QIODevice::ReadWrite | QIODevice::Truncate) : QIODevice::WriteOnly);
+	if (!outFile->isOpen())
+	{
+		printLine("Error! file open failed");
+		return false;
+	}
+	outFile->seek(0);
+
+	QScopedPointer<PackCache> cache;
+	if (!options.cacheDirName.isEmpty())
+		cache.reset(new PackCache(QDir(options.cacheDirName), options.maxCacheSize));
+
+	CompressionPolicy compressionPolicy(options);
+
+	DatWriter<intSize> writer(outFile, isStreaming, maxUnpackedFileTableSize);
+	QScopedPointer<TarReader> tarReader(options.tarInput ? new TarReader(options.tarInput) : nullptr);
+	int nextFileIndex = 0;
+	int reusedFileCount = 0;
+
+	// tar entries keep their stream order in the table, just like scanned files keep the directory order
+	auto prepare = [&](CompressTask<intSize> & task) -> bool
+	{
+		if (tarReader)
+		{
+			StatsTimer statsTimer(Stats::CompressReadStage);
+			QString tarFilePath;
+			if (!tarReader->readNext(tarFilePath, task.fileData))
+				return false;
+			statsTimer.setBytes(task.fileData.size());
+			task.index = nextFileIndex++;
+			task.scannedFile = nullptr;
+			task.relativeFilePath = tarFilePath.replace("/", "\\");
+		}
+		else
+		{
+			if (nextFileIndex >= scannedFiles.size())
+				return false;
+			task.index = nextFileIndex++;
+			task.scannedFile = &scannedFiles.at(task.index);
+			task.relativeFilePath = relativeFilePaths.at(task.index);
+		}
+		task.isReused = false;
+		task.compressionLevel = compressionPolicy.levelFor(task.relativeFilePath);
+		task.baseEntry = nullptr;
+		task.contentKey.clear();
+		task.isDuplicate = false;
+		task.packedFileData.clear();
+
+		const QHash<QString, int>::const_iterator it = baseEntryIndex.constFind(normalizeEntryPath(task.relativeFilePath));
+		if (it != baseEntryIndex.constEnd())
+		{
+			// the base packed data is handed to the worker, which decides whether it can be reused
+			task.baseEntry = &baseEntries.at(it.value());
+			const DatFileTableItem<intSize> & baseFileItem = task.baseEntry->fileItem;
+			const qint64 dataPos = baseDataBeginPos + baseFileItem.dataOffset;
+			if (dataPos < 0 || baseFileItem.packedSize < 0 || baseFileItem.packedSize > BnsTool::MaxEntrySize)
+			{
+				// an entry that can not be read is simply not reused
+				task.baseEntry = nullptr;
+			}
+			else if (mappedBaseFile && dataPos + baseFileItem.packedSize <= baseFileSize)
+			{
+				task.packedFileData = QByteArray::fromRawData((const char*)mappedBaseFile + dataPos, (int)baseFileItem.packedSize);
+			}
+			else
+			{
+				baseFile.seek(dataPos);
+				task.packedFileData = baseFile.read(baseFileItem.packedSize);
+			}
+		}
+		return true;
+	};
+
+	// With --dedup the first worker to see a content packs it and publishes the result in packedContents,
+	// every other task with that content skips packing and shares the data of whichever entry is written first.
+	// Level and xml conversion are part of the key, they change what the same content packs to.
+	QMutex dedupMutex;
+	QSet<QByteArray> claimedContentKeys;
+	// isReused travels with the data, a duplicate of a file copied from the base dat is copied from it as well
+	struct PackedContent
+	{
+		DatFileTableItem<intSize> fileItem;
+		QByteArray packedFileData;
+		bool isReused;
+	};
+	QHash<QByteArray, PackedContent> packedContents;
+	QHash<QByteArray, QPair<DatFileTableItem<intSize>, bool>> writtenContents;
+	int duplicateFileCount = 0;
+	qint64 dedupSavedSize = 0;
+
+	// Workers produce the packed data and the table item, only dataOffset is left to the ordered assembly below.
+	const QString inDirPath = inDir.path();
+	// entries are limited to what one QByteArray holds, a larger file fails the whole run instead of being left out
+	QAtomicInt oversizedFileCount(0);
+	auto packTask = [&](CompressTask<intSize> & task)
+	{
+		QByteArray fileData;
+		if (!task.scannedFile)
+		{
+			task.isOpened = true;
+			fileData.swap(task.fileData);
+		}
+		else
+		{
+			StatsTimer statsTimer(Stats::CompressReadStage);
+			QFile file(inDirPath + "/" + task.scannedFile->relativeFilePath);
+			task.isOpened = file.open(QIODevice::ReadOnly);
+			if (!task.isOpened)
+				return;
+			// the scanner already knows the size, so the buffer is allocated once and filled with a single read
+			const qint64 scannedSize = task.scannedFile->size;
+			if (scannedSize > BnsTool::MaxEntrySize)
+			{
+				printLine(QString("Error! file %1 of %2 bytes is too large to pack").arg(task.relativeFilePath).arg(scannedSize));
+				oversizedFileCount.fetchAndAddRelaxed(1);
+				task.isOpened = false;
+				return;
+			}
+			fileData = QByteArray((int)scannedSize, Qt::Uninitialized);
+			if (file.read(fileData.data(), scannedSize) != scannedSize || !file.atEnd())
+			{
+				// changed since it was scanned
+				file.seek(0);
+				fileData = file.readAll();
+			}
+			statsTimer.setBytes(fileData.size());
+		}
+
+		const bool isTextXml = task.relativeFilePath.endsWith(".xml", Qt::CaseInsensitive) && fileData.startsWith("<?xml");
+		if (options.deduplicate)
+		{
+			QCryptographicHash hash(QCryptographicHash::Sha1);
+			hash.addData(fileData);
+			hash.addData(QString("level=%1;xml=%2").arg(task.compressionLevel).arg(isTextXml).toLatin1());
+			task.contentKey = hash.result();
+
+			QMutexLocker locker(&dedupMutex);
+			if (claimedContentKeys.contains(task.contentKey))
+			{
+				task.isDuplicate = true;
+				task.fileItem = DatFileTableItem<intSize>();
+				task.fileItem.unpackedSize = fileData.size();
+				return;
+			}
+			claimedContentKeys.insert(task.contentKey);
+		}
+
+		if (task.baseEntry)
+		{
+			StatsTimer statsTimer(Stats::BaseCompareStage, fileData.size());
+			if (isSameAsBaseEntry<intSize>(fileData, isTextXml, task.baseEntry->fileItem, task.packedFileData))
+			{
+				task.isReused = true;
+				task.fileItem = task.baseEntry->fileItem;
+				return;
+			}
+			task.packedFileData.clear();
+		}
+
+		task.fileItem = DatFileTableItem<intSize>();
+		task.fileItem.unknown1 = 2;
+		task.fileItem.isCompressed = true;
+		task.fileItem.isEncrypted = true;
+
+		QByteArray cacheKey;
+		if (cache)
+		{
+			const QByteArray parameterTag = QString("compressed=%1;encrypted=%2;level=%3;backend=%4;xml=%5")
+				.arg(task.fileItem.isCompressed).arg(task.fileItem.isEncrypted).arg(task.compressionLevel).arg(BnsTool::compressionBackendName())
+				.arg(isTextXml ? BnsTool::XmlText2BinVersion : 0).toLatin1();
+			StatsTimer statsTimer(Stats::CacheStage, fileData.size());
+			cacheKey = PackCache::makeKey(fileData, parameterTag);
+
+			PackCache::Entry cacheEntry;
+			if (cache->lookup(cacheKey, cacheEntry))
+			{
+				task.packedFileData = cacheEntry.packedFileData;
+				task.fileItem.isCompressed = cacheEntry.isCompressed;
+				task.fileItem.unpackedSize = cacheEntry.unpackedSize;
+				task.fileItem.intermediateSize = cacheEntry.intermediateSize;
+				task.fileItem.packedSize = task.packedFileData.size();
+				return;
+			}
+		}
+
+		if (isTextXml)
+			fileData = BnsTool::xmlText2Bin(fileData);
+
+		// entries that do not shrink are stored, the game reads isCompressed per entry
+		qint32 intermediateCompressedSize = 0;
+		bool isCompressed = true;
+		task.packedFileData = BnsTool::pack(fileData, task.fileItem.isEncrypted, task.fileItem.isCompressed, &intermediateCompressedSize,
+			task.compressionLevel, &isCompressed);
+
+		task.fileItem.isCompressed = isCompressed;
+		task.fileItem.unpackedSize = fileData.size();
+		task.fileItem.intermediateSize = intermediateCompressedSize;
+		task.fileItem.packedSize = task.packedFileData.size();
+
+		if (cache)
+		{
+			StatsTimer statsTimer(Stats::CacheStage, task.packedFileData.size());
+			PackCache::Entry cacheEntry;
+			cacheEntry.packedFileData = task.packedFileData;
+			cacheEntry.intermediateSize = intermediateCompressedSize;
+			cacheEntry.unpackedSize = fileData.size();
+			cacheEntry.isCompressed = isCompressed;
+			cache->store(cacheKey, cacheEntry);
+		}
+	};
+
+	auto process = [&packTask](CompressTask<intSize> & task)
+	{
+		if (!Stats::isEnabled())
+		{
+			packTask(task);
+			return;
+		}
+		QElapsedTimer entryTimer;
+		entryTimer.start();
+		packTask(task);
+		if (task.isOpened)
+			Stats::addEntry(task.relativeFilePath, entryTimer.nsecsElapsed(), task.fileItem.unpackedSize);
+	};
+
+	auto publish = [&](CompressTask<intSize> & task)
+	{
+		process(task);
+		if (task.isOpened && !task.contentKey.isEmpty() && !task.isDuplicate)
+		{
+			QMutexLocker locker(&dedupMutex);
+			const PackedContent packedContent = { task.fileItem, task.packedFileData, task.isReused };
+			packedContents.insert(task.contentKey, packedContent);
+		}
+	};
+
+	auto finish = [&](CompressTask<intSize> & task)
+	{
+		if (tarReader)
+			printLine(QString("%1  %2").arg(task.index + 1).arg(task.relativeFilePath));
+		else
+			printLine(QString("%1 / %2  %3").arg(task.index + 1).arg(scannedFiles.size()).arg(task.relativeFilePath));
+		if (!task.isOpened)
+		{
+			printLine(QString("Warning! file %1 open failed").arg(task.relativeFilePath));
+			return;
+		}
+
+		if (!task.contentKey.isEmpty())
+		{
+			const typename QHash<QByteArray, QPair<DatFileTableItem<intSize>, bool>>::const_iterator it = writtenContents.constFind(task.contentKey);
+			if (it != writtenContents.constEnd())
+			{
+				duplicateFileCount++;
+				if (it.value().second)
+					reusedFileCount++;
+				dedupSavedSize += it.value().first.packedSize;
+				writer.addSharedEntry(task.relativeFilePath, it.value().first);
+				task.packedFileData.clear();
+				return;
+			}
+			// the task that packed this content comes later in the same batch, its result is published already
+			QMutexLocker locker(&dedupMutex);
+			const PackedContent packedContent = packedContents.take(task.contentKey);
+			if (task.isDuplicate)
+			{
+				task.fileItem = packedContent.fileItem;
+				task.packedFileData = packedContent.packedFileData;
+				task.isReused = packedContent.isReused;
+			}
+		}
+
+		if (task.isReused)
+			reusedFileCount++;
+		StatsTimer statsTimer(Stats::CompressWriteStage, task.packedFileData.size());
+		writer.addEntry(task.relativeFilePath, task.fileItem, task.packedFileData);
+		if (!task.contentKey.isEmpty())
+			writtenContents.insert(task.contentKey, qMakePair(task.fileItem, task.isReused));
+		task.packedFileData.clear();
+	};
+
+	const int threadCount = resolveThreadCount(options.threadCount);
+	runOrderedPipeline<CompressTask<intSize>>(threadCount, threadCount * 4, prepare, publish, finish);
+
+	if (mappedBaseFile)
+		baseFile.unmap(mappedBaseFile);
+
+	// a partial dat would look valid to the next stage of a pipeline
+	if (tarReader && tarReader->failed())
+	{
+		printLine("Error! reading the tar stream failed");
+		outFile->remove();
+		return false;
+	}
+	if (oversizedFileCount.load() > 0)
+	{
+		printLine(QString("Error! %1 files are too large to pack").arg(oversizedFileCount.load()));
+		outFile->remove();
+		return false;
+	}
+
+	if (!writer.finish())
+	{
+		outFile->remove();
+		return false;
+	}
+
+	if (!options.baseFileName.isEmpty())
+		printLine(QString("Reused %1 of %2 files from %3").arg(reusedFileCount).arg(nextFileIndex).arg(options.baseFileName));
+	if (options.deduplicate)
+		printLine(QString("Dedup: %1 duplicate files share data, %2 bytes saved").arg(duplicateFileCount).arg(dedupSavedSize));
+	if (cache)
+	{
+		cache->trim();
+		printLine(QString("Pack cache: %1 hits, %2 misses, %3 stored, %4 evicted (%5 bytes)")
+			.arg(cache->hitCount()).arg(cache->missCount()).arg(cache->storeCount()).arg(cache->evictedCount()).arg(cache->evictedSize()));
+	}
+	printLine(QString("Compress finished, %1 bytes").arg(outFile->size()));
+	return true;
+}
+
+// Reads the packed data of an entry, pointing into the mapping when there is one. Fails for offsets and
+// sizes the table can hold but one QByteArray can not, and for data cut short by the end of the file.
+template <int intSize>
+static bool readPackedFileData(QFile * inFile, const uchar * mappedFile, qint64 dataBeginPos, const DatFileEntry<intSize> & entry, QByteArray & packedFileData)
+{
+	const DatFileTableItem<intSize> & fileItem = entry.fileItem;
+	const qint64 dataPos = dataBeginPos + fileItem.dataOffset;
+	if (dataPos < 0 || fileItem.packedSize < 0 || fileItem.packedSize > BnsTool::MaxEntrySize)
+	{
+		printLine(QString("Error! file %1 has an invalid packed size or offset").arg(entry.relativeFilePath));
+		packedFileData.clear();
+		return false;
+	}
+	if (mappedFile && dataPos + fileItem.packedSize <= inFile->size())
+	{
+		packedFileData = QByteArray::fromRawData((const char*)mappedFile + dataPos, (int)fileItem.packedSize);
+		return true;
+	}
+
+	StatsTimer statsTimer(Stats::ExtractReadStage, fileItem.packedSize);
+	inFile->seek(dataPos);
+	packedFileData = inFile->read(fileItem.packedSize);
+	if (packedFileData.size() != fileItem.packedSize)
+	{
+		printLine(QString("Error! file %1 is cut short").arg(entry.relativeFilePath));
+		return false;
+	}
+	return true;
+}
+
+template <int intSize>
+struct PatchTask
+{
+	const DatFileEntry<intSize> * entry;
+	int index;
+	XmlPatch xmlPatch;
+	QByteArray packedFileData;
+	DatFileTableItem<intSize> fileItem;
+	int changeCount;
+	bool isFailed;
+};
+
+// Copies the dat entry by entry. Only entries that a section of the rule file applies to are unpacked,
+// the rest keep their packed data, and the table keeps its order so the output differs only where values changed.
+template <int intSize>
+bool patch(QFile * inFile, QFile * outFile, const XmlPatch & xmlPatch, const BnsTool::PatchOptions & options)
+{
+	if (!inFile || !outFile)
+		return false;
+	printLine(QString("Patching %1 to %2").arg(inFile->fileName()).arg(outFile->fileName()));
+
+	const QString inFilePath = QFileInfo(*inFile).canonicalFilePath();
+	if (!inFilePath.isEmpty() && inFilePath == QFileInfo(*outFile).canonicalFilePath())
+	{
+		printLine("Error! input file can not be the output file");
+		return false;
+	}
+
+	DatFileHeader<intSize> header;
+	qint64 dataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> entries;
+	if (!readDatFile<intSize>(inFile, header, dataBeginPos, entries))
+		return false;
+
+	if (!outFile->isOpen())
+		outFile->open(QIODevice::ReadWrite | QIODevice::Truncate);
+	if (!outFile->isOpen())
+	{
+		printLine("Error! file open failed");
+		return false;
+	}
+	outFile->seek(0);
+
+	uchar * mappedFile = options.useFileMapping ? inFile->map(0, inFile->size()) : nullptr;
+
+	// paths do not change, so the table of the input tells how much room the output table needs
+	DatWriter<intSize> writer(outFile, true, header.unpackedFileTableSize);
+	int nextIndex = 0;
+	int patchedFileCount = 0;
+	int totalChangeCount = 0;
+	bool isReadFailed = false;
+
+	auto prepare = [&](PatchTask<intSize> & task) -> bool
+	{
+		if (nextIndex >= entries.size() || isReadFailed)
+			return false;
+		task.index = nextIndex++;
+		task.entry = &entries.at(task.index);
+		task.fileItem = task.entry->fileItem;
+		task.xmlPatch = xmlPatch.select(task.entry->relativeFilePath);
+		task.changeCount = 0;
+		task.isFailed = false;
+		if (!readPackedFileData<intSize>(inFile, mappedFile, dataBeginPos, *task.entry, task.packedFileData))
+		{
+			isReadFailed = true;
+			return false;
+		}
+		return true;
+	};
+
+	auto process = [](PatchTask<intSize> & task)
+	{
+		if (task.xmlPatch.isEmpty())
+			return;
+		const QByteArray fileData = BnsTool::unpack(task.packedFileData, task.fileItem.unpackedSize, task.fileItem.isEncrypted, task.fileItem.isCompressed);
+		// plain files in a matching section are left alone
+		if (!fileData.startsWith("LMXBOSLB"))
+			return;
+
+		QByteArray patchedFileData;
+		if (!task.xmlPatch.apply(fileData, patchedFileData, task.changeCount))
+		{
+			task.isFailed = true;
+			return;
+		}
+		if (task.changeCount == 0)
+			return;
 
-static AES_KEY aesEncryptKey;
-static AES_KEY aesDecryptKey;
+		qint32 intermediateCompressedSize = 0;
+		bool isCompressed = task.fileItem.isCompressed;
+		task.packedFileData = BnsTool::pack(patchedFileData, task.fileItem.isEncrypted, task.fileItem.isCompressed, &intermediateCompressedSize,
+			BnsTool::DefaultLevel, &isCompressed);
+		task.fileItem.isCompressed = isCompressed;
+		task.fileItem.unpackedSize = patchedFileData.size();
+		task.fileItem.intermediateSize = intermediateCompressedSize;
+		task.fileItem.packedSize = task.packedFileData.size();
+	};
+
+	auto finish = [&](PatchTask<intSize> & task)
+	{
+		if (task.isFailed)
+		{
+			printLine(QString("Warning! %1 is not valid binary xml, left unchanged").arg(task.entry->relativeFilePath));
+		}
+		else if (task.changeCount > 0)
+		{
+			printLine(QString("%1  %2 changes").arg(task.entry->relativeFilePath).arg(task.changeCount));
+			patchedFileCount++;
+			totalChangeCount += task.changeCount;
+		}
+		StatsTimer statsTimer(Stats::CompressWriteStage, task.packedFileData.size());
+		writer.addEntry(task.entry->relativeFilePath, task.fileItem, task.packedFileData);
+		task.packedFileData.clear();
+	};
+
+	const int threadCount = resolveThreadCount(options.threadCount);
+	runOrderedPipeline<PatchTask<intSize>>(threadCount, threadCount * 4, prepare, process, finish);
+
+	if (mappedFile)
+		inFile->unmap(mappedFile);
 
-static int globalInit()
+	if (isReadFailed || !writer.finish())
+		return false;
+
+	printLine(QString("Patch finished, %1 changes in %2 files, %3 bytes").arg(totalChangeCount).arg(patchedFileCount).arg(outFile->size()));
+	return true;
+}
+
+// A delta is an ordinary dat holding the changed and added entries of the target plus a manifest entry.
+// The manifest lists every target entry in order, as "K <hash> <path>" when the base entry is kept or
+// "C <path>" when the entry comes from the delta, and the removed paths as "R <path>". The hash is the
+// SHA-1 of the packed base data, so applying a delta to a different base fails instead of mixing files.
+static const char DeltaManifestPath[] = "__delta__\\manifest.txt";
+static const char DeltaManifestSignature[] = "BNSDELTA 1";
+
+static QByteArray hashPackedFileData(const QByteArray & packedFileData)
 {
-	AES_set_encrypt_key(CryptKeyText, sizeof(CryptKeyText) * 8, &aesEncryptKey);
-	AES_set_decrypt_key(CryptKeyText, sizeof(CryptKeyText) * 8, &aesDecryptKey);
-	return 0;
+	return QCryptographicHash::hash(packedFileData, QCryptographicHash::Sha1).toHex();
 }
 
-static const int init_dummy = globalInit();
+template <int intSize>
+struct DiffTask
+{
+	const DatFileEntry<intSize> * entry;
+	const DatFileEntry<intSize> * baseEntry;
+	QByteArray packedFileData;
+	QByteArray basePackedFileData;
+	QByteArray baseHash;
+	bool isKept;
+};
+
+// Entries with the same packed bytes are kept without unpacking, only entries whose packed data differs
+// but whose unpacked size matches are unpacked to see whether just the packing changed.
+template <int intSize>
+static void compareEntry(DiffTask<intSize> & task)
+{
+	task.isKept = false;
+	if (!task.baseEntry)
+		return;
+	const DatFileTableItem<intSize> & fileItem = task.entry->fileItem;
+	const DatFileTableItem<intSize> & baseFileItem = task.baseEntry->fileItem;
+	if (fileItem.unpackedSize != baseFileItem.unpackedSize)
+		return;
+
+	StatsTimer statsTimer(Stats::BaseCompareStage, task.packedFileData.size());
+	task.baseHash = hashPackedFileData(task.basePackedFileData);
+	if (fileItem.packedSize == baseFileItem.packedSize && hashPackedFileData(task.packedFileData) == task.baseHash)
+	{
+		task.isKept = true;
+		return;
+	}
+	const QByteArray fileData = BnsTool::unpack(task.packedFileData, fileItem.unpackedSize, fileItem.isEncrypted, fileItem.isCompressed);
+	const QByteArray baseFileData = BnsTool::unpack(task.basePackedFileData, baseFileItem.unpackedSize, baseFileItem.isEncrypted, baseFileItem.isCompressed);
+	task.isKept = (fileData == baseFileData);
+}
 
-#pragma pack(push, 1)
-template<int intSize>
-struct DatFileHeader
+template <int intSize>
+bool diff(QFile * baseFile, QFile * targetFile, QFile * deltaFile, const BnsTool::DiffOptions & options)
 {
-	typedef typename QIntegerForSize<intSize>::Signed qintX;
+	if (!baseFile || !targetFile || !deltaFile)
+		return false;
+	printLine(QString("Comparing %1 with %2 to %3").arg(baseFile->fileName()).arg(targetFile->fileName()).arg(deltaFile->fileName()));
+
+	DatFileHeader<intSize> baseHeader;
+	qint64 baseDataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> baseEntries;
+	if (!readDatFile<intSize>(baseFile, baseHeader, baseDataBeginPos, baseEntries))
+		return false;
+	DatFileHeader<intSize> header;
+	qint64 dataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> entries;
+	if (!readDatFile<intSize>(targetFile, header, dataBeginPos, entries))
+		return false;
 
-	quint8 signature[8];
-	qint32 version;
-	quint8 unknown1[5];
-	qintX totalFileIntermediateSize;
-	qintX fileCount;
-	bool isCompressed;
-	bool isEncrypted;
-	quint8 unknown2[62];
-	qintX packedFileTableSize;
-	qintX unpackedFileTableSize;
+	QHash<QString, int> baseEntryIndex;
+	baseEntryIndex.reserve(baseEntries.size());
+	for (int i = 0; i < baseEntries.size(); ++i)
+		baseEntryIndex.insert(normalizeEntryPath(baseEntries.at(i).relativeFilePath), i);
 
-	void init()
+	if (!deltaFile->isOpen())
+		deltaFile->open(QIODevice::ReadWrite | QIODevice::Truncate);
+	if (!deltaFile->isOpen())
 	{
-		memset(this, 0, sizeof(DatFileHeader));
-		memcpy(signature, "UOSEDALB", 8);
-		version = 2;
+		printLine("Error! file open failed");
+		return false;
 	}
+	deltaFile->seek(0);
 
-	bool check()
+	uchar * mappedBaseFile = options.useFileMapping ? baseFile->map(0, baseFile->size()) : nullptr;
+	uchar * mappedFile = options.useFileMapping ? targetFile->map(0, targetFile->size()) : nullptr;
+
+	// the delta never holds more entries than the target, plus the manifest
+	const qint64 maxUnpackedFileTableSize = header.unpackedFileTableSize + intSize + sizeof(DeltaManifestPath) * 2 + sizeof(DatFileTableItem<intSize>);
+	DatWriter<intSize> writer(deltaFile, true, maxUnpackedFileTableSize);
+
+	QByteArray manifest = QByteArray(DeltaManifestSignature) + "\n";
+	QSet<int> targetBaseIndexes;
+	int nextIndex = 0;
+	int keptFileCount = 0;
+	int changedFileCount = 0;
+	int addedFileCount = 0;
+	bool isReadFailed = false;
+
+	auto prepare = [&](DiffTask<intSize> & task) -> bool
+	{
+		if (nextIndex >= entries.size() || isReadFailed)
+			return false;
+		task.entry = &entries.at(nextIndex++);
+		task.baseEntry = nullptr;
+		if (!readPackedFileData<intSize>(targetFile, mappedFile, dataBeginPos, *task.entry, task.packedFileData))
+		{
+			isReadFailed = true;
+			return false;
+		}
+		const QHash<QString, int>::const_iterator it = baseEntryIndex.constFind(normalizeEntryPath(task.entry->relativeFilePath));
+		if (it != baseEntryIndex.constEnd())
+		{
+			targetBaseIndexes.insert(it.value());
+			task.baseEntry = &baseEntries.at(it.value());
+			if (!readPackedFileData<intSize>(baseFile, mappedBaseFile, baseDataBeginPos, *task.baseEntry, task.basePackedFileData))
+			{
+				isReadFailed = true;
+				return false;
+			}
+		}
+		return true;
+	};
+
+	auto finish = [&](DiffTask<intSize> & task)
+	{
+		if (task.isKept)
+		{
+			keptFileCount++;
+			manifest += "K\t" + task.baseHash + "\t" + task.entry->relativeFilePath.toUtf8() + "\n";
+		}
+		else
+		{
+			if (task.baseEntry)
+				changedFileCount++;
+			else
+				addedFileCount++;
+			printLine(QString("%1  %2").arg(task.baseEntry ? "changed" : "added").arg(task.entry->relativeFilePath));
+			DatFileTableItem<intSize> fileItem = task.entry->fileItem;
+			writer.addEntry(task.entry->relativeFilePath, fileItem, task.packedFileData);
+			manifest += "C\t" + task.entry->relativeFilePath.toUtf8() + "\n";
+		}
+		task.packedFileData.clear();
+		task.basePackedFileData.clear();
+	};
+
+	const int threadCount = resolveThreadCount(options.threadCount);
+	runOrderedPipeline<DiffTask<intSize>>(threadCount, threadCount * 4, prepare, compareEntry<intSize>, finish);
+
+	int removedFileCount = 0;
+	for (int i = 0; i < baseEntries.size(); ++i)
 	{
-		return memcmp(signature, "UOSEDALB", 8) == 0 && version == 2
-			&& (fileCount > 0 && fileCount < 10000) && packedFileTableSize <= unpackedFileTableSize;
+		if (targetBaseIndexes.contains(i))
+			continue;
+		removedFileCount++;
+		printLine(QString("removed  %1").arg(baseEntries.at(i).relativeFilePath));
+		manifest += "R\t" + baseEntries.at(i).relativeFilePath.toUtf8() + "\n";
 	}
+
+	qint32 intermediateCompressedSize = 0;
+	bool isCompressed = true;
+	DatFileTableItem<intSize> manifestItem = DatFileTableItem<intSize>();
+	manifestItem.unknown1 = 2;
+	manifestItem.isEncrypted = true;
+	const QByteArray packedManifest = BnsTool::pack(manifest, manifestItem.isEncrypted, true, &intermediateCompressedSize, BnsTool::DefaultLevel, &isCompressed);
+	manifestItem.isCompressed = isCompressed;
+	manifestItem.unpackedSize = manifest.size();
+	manifestItem.intermediateSize = intermediateCompressedSize;
+	manifestItem.packedSize = packedManifest.size();
+	writer.addEntry(DeltaManifestPath, manifestItem, packedManifest);
+
+	if (mappedBaseFile)
+		baseFile->unmap(mappedBaseFile);
+	if (mappedFile)
+		targetFile->unmap(mappedFile);
+
+	if (isReadFailed || !writer.finish())
+		return false;
+
+	printLine(QString("Diff finished, %1 kept, %2 changed, %3 added, %4 removed, delta %5 bytes")
+		.arg(keptFileCount).arg(changedFileCount).arg(addedFileCount).arg(removedFileCount).arg(deltaFile->size()));
+	return true;
+}
+
+template <int intSize>
+struct ApplyTask
+{
+	QString relativeFilePath;
+	bool isKept;
+	QByteArray expectedHash;
+	const DatFileEntry<intSize> * entry;
+	QByteArray packedFileData;
+	bool isMatched;
 };
 
-template<int intSize>
-struct DatFileTableItem
+template <int intSize>
+bool apply(QFile * baseFile, QFile * deltaFile, QFile * outFile, const BnsTool::DiffOptions & options)
 {
-	typedef typename QIntegerForSize<intSize>::Signed qintX;
+	if (!baseFile || !deltaFile || !outFile)
+		return false;
+	printLine(QString("Applying %1 to %2 as %3").arg(deltaFile->fileName()).arg(baseFile->fileName()).arg(outFile->fileName()));
 
-	quint8 unknown1;
-	bool isCompressed;
-	bool isEncrypted;
-	quint8 unknown2;
-	qintX unpackedSize;
-	qintX intermediateSize;		// ѹǰĴСȡpackedSize
-	qintX packedSize;
-	qintX dataOffset;
-	quint8 padding[60];
-};
+	const QString outFilePath = QFileInfo(*outFile).canonicalFilePath();
+	if (!outFilePath.isEmpty() && (outFilePath == QFileInfo(*baseFile).canonicalFilePath() || outFilePath == QFileInfo(*deltaFile).canonicalFilePath()))
+	{
+		printLine("Error! output file can not be an input file");
+		return false;
+	}
+
+	DatFileHeader<intSize> baseHeader;
+	qint64 baseDataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> baseEntries;
+	if (!readDatFile<intSize>(baseFile, baseHeader, baseDataBeginPos, baseEntries))
+		return false;
+	DatFileHeader<intSize> deltaHeader;
+	qint64 deltaDataBeginPos = 0;
+	QVector<DatFileEntry<intSize>> deltaEntries;
+	if (!readDatFile<intSize>(deltaFile, deltaHeader, deltaDataBeginPos, deltaEntries))
+		return false;
+
+	QHash<QString, int> baseEntryIndex;
+	baseEntryIndex.reserve(baseEntries.size());
+	for (int i = 0; i < baseEntries.size(); ++i)
+		baseEntryIndex.insert(normalizeEntryPath(baseEntries.at(i).relativeFilePath), i);
+	QHash<QString, int> deltaEntryIndex;
+	deltaEntryIndex.reserve(deltaEntries.size());
+	for (int i = 0; i < deltaEntries.size(); ++i)
+		deltaEntryIndex.insert(normalizeEntryPath(deltaEntries.at(i).relativeFilePath), i);
+
+	const int manifestIndex = deltaEntryIndex.value(normalizeEntryPath(DeltaManifestPath), -1);
+	if (manifestIndex < 0)
+	{
+		printLine("Error! delta manifest not found");
+		return false;
+	}
+	const DatFileTableItem<intSize> & manifestItem = deltaEntries.at(manifestIndex).fileItem;
+	QByteArray packedManifest;
+	if (!readPackedFileData<intSize>(deltaFile, nullptr, deltaDataBeginPos, deltaEntries.at(manifestIndex), packedManifest))
+		return false;
+	const QByteArray manifest = BnsTool::unpack(packedManifest, manifestItem.unpackedSize, manifestItem.isEncrypted, manifestItem.isCompressed);
+	QList<QByteArray> manifestLines = manifest.split('\n');
+	if (manifestLines.isEmpty() || manifestLines.takeFirst() != DeltaManifestSignature)
+	{
+		printLine("Error! unknown delta manifest");
+		return false;
+	}
+
+	QVector<ApplyTask<intSize>> tasks;
+	qint64 maxUnpackedFileTableSize = 0;
+	int removedFileCount = 0;
+	for (const QByteArray & line : manifestLines)
+	{
+		if (line.isEmpty())
+			continue;
+		const QList<QByteArray> fields = line.split('\t');
+		if (fields.first() == "R" && fields.size() == 2)
+		{
+			removedFileCount++;
+			continue;
+		}
+
+		ApplyTask<intSize> task;
+		task.isKept = (fields.first() == "K" && fields.size() == 3);
+		task.relativeFilePath = QString::fromUtf8(fields.last());
+		if (task.isKept)
+			task.expectedHash = fields.at(1);
+		const QHash<QString, int> & entryIndex = task.isKept ? baseEntryIndex : deltaEntryIndex;
+		const QHash<QString, int>::const_iterator it = entryIndex.constFind(normalizeEntryPath(task.relativeFilePath));
+		if ((!task.isKept && (fields.first() != "C" || fields.size() != 2)) || it == entryIndex.constEnd())
+		{
+			printLine(QString("Error! invalid delta manifest line %1").arg(QString::fromUtf8(line)));
+			return false;
+		}
+		task.entry = task.isKept ? &baseEntries.at(it.value()) : &deltaEntries.at(it.value());
+		maxUnpackedFileTableSize += intSize + task.relativeFilePath.length() * 2 + sizeof(DatFileTableItem<intSize>);
+		tasks.append(task);
+	}
+
+	if (!outFile->isOpen())
+		outFile->open(QIODevice::ReadWrite | QIODevice::Truncate);
+	if (!outFile->isOpen())
+	{
+		printLine("Error! file open failed");
+		return false;
+	}
+	outFile->seek(0);
+
+	uchar * mappedBaseFile = options.useFileMapping ? baseFile->map(0, baseFile->size()) : nullptr;
+	uchar * mappedDeltaFile = options.useFileMapping ? deltaFile->map(0, deltaFile->size()) : nullptr;
+
+	DatWriter<intSize> writer(outFile, true, maxUnpackedFileTableSize);
+	int nextIndex = 0;
+	int keptFileCount = 0;
+	bool isMismatched = false;
+	bool isReadFailed = false;
+
+	auto prepare = [&](ApplyTask<intSize> & task) -> bool
+	{
+		if (nextIndex >= tasks.size() || isMismatched || isReadFailed)
+			return false;
+		task = tasks.at(nextIndex++);
+		const bool isRead = task.isKept
+			? readPackedFileData<intSize>(baseFile, mappedBaseFile, baseDataBeginPos, *task.entry, task.packedFileData)
+			: readPackedFileData<intSize>(deltaFile, mappedDeltaFile, deltaDataBeginPos, *task.entry, task.packedFileData);
+		if (!isRead)
+		{
+			isReadFailed = true;
+			return false;
+		}
+		return true;
+	};
+
+	auto process = [](ApplyTask<intSize> & task)
+	{
+		task.isMatched = true;
+		if (task.isKept)
+		{
+			StatsTimer statsTimer(Stats::BaseCompareStage, task.packedFileData.size());
+			task.isMatched = (hashPackedFileData(task.packedFileData) == task.expectedHash);
+		}
+	};
+
+	auto finish = [&](ApplyTask<intSize> & task)
+	{
+		if (!task.isMatched)
+		{
+			if (!isMismatched)
+				printLine(QString("Error! %1 differs from the base the delta was made for").arg(task.relativeFilePath));
+			isMismatched = true;
+			return;
+		}
+		if (task.isKept)
+			keptFileCount++;
+		DatFileTableItem<intSize> fileItem = task.entry->fileItem;
+		writer.addEntry(task.relativeFilePath, fileItem, task.packedFileData);
+		task.packedFileData.clear();
+	};
+
+	const int threadCount = resolveThreadCount(options.threadCount);
+	runOrderedPipeline<ApplyTask<intSize>>(threadCount, threadCount * 4, prepare, process, finish);
+
+	if (mappedBaseFile)
+		baseFile->unmap(mappedBaseFile);
+	if (mappedDeltaFile)
+		deltaFile->unmap(mappedDeltaFile);
+
+	if (isMismatched || isReadFailed || !writer.finish())
+		return false;
+
+	printLine(QString("Apply finished, %1 kept, %2 from delta, %3 removed, %4 bytes")
+		.arg(keptFileCount).arg(tasks.size() - keptFileCount).arg(removedFileCount).arg(outFile->size()));
+	return true;
+}
+
+
+bool BnsTool::list(QFile * inFile)
+{
+	return ::list(inFile);
+}
+
+bool BnsTool::list64(QFile * inFile)
+{
+	return ::list(inFile);
+}
+
+bool BnsTool::extract(QFile * inFile, QDir outDir, const ExtractOptions & options)
+{
+	return ::extract<4>(inFile, outDir, options);
+}
+
+bool BnsTool::extract64(QFile * inFile, QDir outDir, const ExtractOptions & options)
+{
+	return ::extract<8>(inFile, outDir, options);
+}
+
+bool BnsTool::compress(QDir inDir, QFile * outFile, const CompressOptions & options)
+{
+	return ::compress<4>(inDir, outFile, options);
+}
+
+bool BnsTool::compress64(QDir inDir, QFile * outFile, const CompressOptions & options)
+{
+	return ::compress<8>(inDir, outFile, options);
+}
+
+bool BnsTool::patch(QFile * inFile, QFile * outFile, const XmlPatch & xmlPatch, const PatchOptions & options)
+{
+	return ::patch<4>(inFile, outFile, xmlPatch, options);
+}
+
+bool BnsTool::patch64(QFile * inFile, QFile * outFile, const XmlPatch & xmlPatch, const PatchOptions & options)
+{
+	return ::patch<8>(inFile, outFile, xmlPatch, options);
+}
+
+bool BnsTool::diff(QFile * baseFile, QFile * targetFile, QFile * deltaFile, const DiffOptions & options)
+{
+	return ::diff<4>(baseFile, targetFile, deltaFile, options);
+}
+
+bool BnsTool::diff64(QFile * baseFile, QFile * targetFile, QFile * deltaFile, const DiffOptions & options)
+{
+	return ::diff<8>(baseFile, targetFile, deltaFile, options);
+}
+
+bool BnsTool::apply(QFile * baseFile, QFile * deltaFile, QFile * outFile, const DiffOptions & options)
+{
+	return ::apply<4>(baseFile, deltaFile, outFile, options);
+}
+
+bool BnsTool::apply64(QFile * baseFile, QFile * deltaFile, QFile * outFile, const DiffOptions & options)
+{
+	return ::apply<8>(baseFile, deltaFile, outFile, options);
+}
+
+// Decrypts size bytes from in to out, a trailing partial block is zero padded to a whole one,
+// so out needs room for getPaddedSize(size, AES_BLOCK_SIZE) bytes.
+static void decryptPadded(const uchar * in, int size, uchar * out)
+{
+	AesBackend * aes = AesBackend::current();
+	const int wholeBlockSize = size - size % AES_BLOCK_SIZE;
+	aes->decrypt(in, out, wholeBlockSize);
+	if (wholeBlockSize < size)
+	{
+		uchar lastBlock[AES_BLOCK_SIZE] = { 0 };
+		memcpy(lastBlock, in + wholeBlockSize, size - wholeBlockSize);
+		aes->decrypt(lastBlock, out + wholeBlockSize, AES_BLOCK_SIZE);
+	}
+}
 
-struct BinXmlHeader
+// zlib inflate into a buffer sized from the file table, it only grows if the recorded size is wrong.
+class Inflater
 {
-	quint8 signature[8];
-	qint32 version;
-	qint32 fileSize;
-	quint8 padding[64];
-	quint8 unknown1;
+public:
+	explicit Inflater(int expectedSize)
+		: result(qMax(expectedSize, 1), Qt::Uninitialized), status(Z_OK)
+	{
+		memset(&stream, 0, sizeof(stream));
+		if (inflateInit(&stream) != Z_OK)
+			status = Z_STREAM_ERROR;
+		stream.next_out = (Bytef*)result.data();
+		stream.avail_out = result.size();
+	}
+
+	~Inflater()
+	{
+		inflateEnd(&stream);
+	}
+
+	bool isRunning() const
+	{
+		return status == Z_OK;
+	}
+
+	void feed(const uchar * data, int size)
+	{
+		stream.next_in = (Bytef*)data;
+		stream.avail_in = size;
+		while (status == Z_OK)
+		{
+			// With the recorded size reached usually only the adler32 trailer is left, so a full buffer is
+			// not grown right away. inflate writes into scratch instead, only real output there grows result.
+			const bool isFull = (stream.avail_out == 0);
+			uchar scratch[64];
+			if (isFull)
+			{
+				stream.next_out = scratch;
+				stream.avail_out = sizeof(scratch);
+			}
+			const int inflateStatus = inflate(&stream, Z_NO_FLUSH);
+			if (isFull)
+			{
+				const int usedSize = result.size();
+				const int scratchSize = sizeof(scratch) - stream.avail_out;
+				if (scratchSize > 0)
+				{
+					result.resize(qMax(usedSize * 2, usedSize + scratchSize));
+					memcpy(result.data() + usedSize, scratch, scratchSize);
+				}
+				stream.next_out = (Bytef*)result.data() + usedSize + scratchSize;
+				stream.avail_out = result.size() - usedSize - scratchSize;
+			}
+			if (inflateStatus == Z_BUF_ERROR || (inflateStatus == Z_OK && stream.avail_in == 0 && stream.avail_out > 0))
+				break;
+			status = inflateStatus;
+		}
+	}
 
-	void init()
+	QByteArray take()
 	{
-		memset(this, 0, sizeof(BinXmlHeader));
-		memcpy(signature, "LMXBOSLB", 8);
-		version = 3;
-		unknown1 = 1;
+		if (status != Z_STREAM_END)
+		{
+			printLine(QString("Warning! inflate failed, %1").arg(stream.msg ? stream.msg : "unexpected end of data"));
+			return QByteArray();
+		}
+		result.resize(stream.total_out);
+		return result;
 	}
+
+private:
+	z_stream stream;
+	QByteArray result;
+	int status;
 };
-#pragma pack(pop)
 
-static void xor (quint8 * buffer, int size)
+QByteArray BnsTool::unpack(const QByteArray & bytes, qint64 unpackedSize, bool isEncrypted, bool isCompressed)
 {
-	static const quint8 XorKey[] = { 0xA4, 0x9F, 0xD8, 0xB3, 0xF6, 0x8E, 0x39, 0xC2, 0x2D, 0xE0, 0x61, 0x75, 0x5C, 0x4B, 0x1A, 0x07 };
-	for (int i = 0; i < size; ++i)
-		buffer[i] ^= XorKey[i % sizeof(XorKey)];
+	const uchar * inPtr = (const uchar*)bytes.constData();
+
+	// archives may be larger than 2 GB, but a single entry still has to fit into one QByteArray
+	if (unpackedSize > MaxEntrySize || bytes.size() > MaxEntrySize)
+	{
+		printLine(QString("Warning! entry of %1 bytes is too large to unpack").arg(unpackedSize));
+		return QByteArray();
+	}
+
+	if (!isCompressed)
+	{
+		if (!isEncrypted)
+			return bytes;
+		// bytes may be raw data over a file mapping, so decrypt from it into result instead of copying it first
+		StatsTimer statsTimer(Stats::DecryptStage, bytes.size());
+		QByteArray result((int)getPaddedSize(bytes.size(), AES_BLOCK_SIZE), Qt::Uninitialized);
+		decryptPadded(inPtr, bytes.size(), (uchar*)result.data());
+		if (unpackedSize >= 0 && unpackedSize < result.size())
+			result.resize(unpackedSize);
+		return result;
+	}
+
+	// decrypt and inflate alternate chunk by chunk, so their times are added up separately and reported once
+	const bool isTimed = Stats::isEnabled();
+	QElapsedTimer timer;
+	qint64 decryptTime = 0;
+	qint64 inflateTime = 0;
+
+	Inflater inflater((int)unpackedSize);
+	if (isEncrypted)
+	{
+		// decrypt a few KB at a time so the inflater reads them back from L1 instead of a whole decrypted copy
+		const int ChunkSize = 16 * 1024;
+		uchar chunk[ChunkSize];
+		for (int offset = 0; offset < bytes.size() && inflater.isRunning(); offset += ChunkSize)
+		{
+			const int chunkSize = qMin(ChunkSize, bytes.size() - offset);
+			if (isTimed)
+				timer.start();
+			decryptPadded(inPtr + offset, chunkSize, chunk);
+			if (isTimed)
+			{
+				decryptTime += timer.nsecsElapsed();
+				timer.start();
+			}
+			inflater.feed(chunk, (int)getPaddedSize(chunkSize, AES_BLOCK_SIZE));
+			if (isTimed)
+				inflateTime += timer.nsecsElapsed();
+		}
+	}
+	else
+	{
+		if (isTimed)
+			timer.start();
+		inflater.feed(inPtr, bytes.size());
+		if (isTimed)
+			inflateTime += timer.nsecsElapsed();
+	}
+
+	if (isTimed)
+	{
+		if (isEncrypted)
+			Stats::add(Stats::DecryptStage, decryptTime, bytes.size());
+		Stats::add(Stats::InflateStage, inflateTime, unpackedSize);
+	}
+	return inflater.take();
 }
 
-static int getPaddedSize(int size, int base)
+bool BnsTool::parseCompressionLevel(const QString & name, CompressionLevel & level)
 {
-	return ((size - 1) / base + 1) * base;
+	static const char * const LevelNames[] = { "store", "fast", "default", "max" };
+	for (int i = 0; i < int(sizeof(LevelNames) / sizeof(LevelNames[0])); ++i)
+	{
+		if (name.compare(LevelNames[i], Qt::CaseInsensitive) == 0)
+		{
+			level = CompressionLevel(i);
+			return true;
+		}
+	}
+	return false;
 }
 
-template <class T>
-static T streamRead(QIODevice * inStream)
+const char * BnsTool::compressionBackendName()
 {
-	T var = T();
-	inStream->read((char*)&var, sizeof(T));
-	return var;
+#ifdef USE_LIBDEFLATE
+	return "libdeflate";
+#else
+	return "zlib";
+#endif
 }
 
-template <class T>
-static bool streamWrite(QIODevice * outStream, const T & value)
+#ifdef USE_LIBDEFLATE
+// libdeflate compressors are expensive to set up and not thread safe, so every thread keeps one per level
+class LibdeflateCompressors
+{
+public:
+	LibdeflateCompressors()
+	{
+		memset(compressors, 0, sizeof(compressors));
+	}
+
+	~LibdeflateCompressors()
+	{
+		for (libdeflate_compressor * compressor : compressors)
+		{
+			if (compressor)
+				libdeflate_free_compressor(compressor);
+		}
+	}
+
+	libdeflate_compressor * get(BnsTool::CompressionLevel level)
+	{
+		static const int Levels[] = { 0, 1, 6, 12 };
+		if (!compressors[level])
+			compressors[level] = libdeflate_alloc_compressor(Levels[level]);
+		return compressors[level];
+	}
+
+private:
+	libdeflate_compressor * compressors[BnsTool::MaxLevel + 1];
+};
+#endif
+
+// Compresses bytes into a zlib stream, leaving room in the buffer for the cipher padding.
+// Returns false if compression failed.
+static bool deflateBytes(const QByteArray & bytes, BnsTool::CompressionLevel level, QByteArray & result)
 {
-	return sizeof(value) == outStream->write((const char*)&value, sizeof(value));
+#ifdef USE_LIBDEFLATE
+	thread_local LibdeflateCompressors compressors;
+	libdeflate_compressor * compressor = compressors.get(level);
+	if (!compressor)
+		return false;
+	const size_t bound = libdeflate_zlib_compress_bound(compressor, bytes.size());
+	result.resize((int)getPaddedSize(bound, AES_BLOCK_SIZE));
+	const size_t size = libdeflate_zlib_compress(compressor, bytes.constData(), bytes.size(), result.data(), bound);
+	if (size == 0)
+		return false;
+#else
+	static const int Levels[] = { 0, 1, Z_DEFAULT_COMPRESSION, 9 };
+	uLongf size = compressBound(bytes.size());
+	result.resize((int)getPaddedSize(size, AES_BLOCK_SIZE));
+	if (compress2((Bytef*)result.data(), &size, (const Bytef*)bytes.constData(), bytes.size(), Levels[level]) != Z_OK)
+		return false;
+#endif
+	// shrinking keeps the allocation, so the padding appended by pack never reallocates
+	result.resize((int)size);
+	return true;
 }
 
-static QString streamReadString(QIODevice * inStream, int length)
+QByteArray BnsTool::pack(QByteArray bytes, bool isEncrypted, bool isCompressed, qint32 * outIntermediateCompressedSize,
+	CompressionLevel compressionLevel, bool * outIsCompressed)
 {
-	QByteArray bytes = inStream->read(length * 2);
-	return QString::fromUtf16((const char16_t *)bytes.data(), bytes.size() / 2);
+	if (compressionLevel == StoreLevel)
+		isCompressed = false;
+
+	QByteArray result;
+	if (isCompressed)
+	{
+		StatsTimer statsTimer(Stats::DeflateStage, bytes.size());
+		// the bulk cipher below works in place, so the stream is written without the length header qCompress would add
+		if (!deflateBytes(bytes, compressionLevel, result))
+		{
+			printLine("Warning! compress failed");
+			result.clear();
+		}
+		else if (outIsCompressed && result.size() >= bytes.size())
+		{
+			isCompressed = false;
+			result = bytes;
+		}
+	}
+	else
+	{
+		result = bytes;
+	}
+	if (outIsCompressed)
+		*outIsCompressed = isCompressed;
+
+	if (outIntermediateCompressedSize)
+		*outIntermediateCompressedSize = result.size();
+
+	if (isEncrypted)
+	{
+		StatsTimer statsTimer(Stats::EncryptStage, result.size());
+		const int paddedSize = (int)getPaddedSize(result.size(), AES_BLOCK_SIZE);
+		if (result.size() < paddedSize)
+			result += QByteArray(paddedSize - result.size(), '\0');
+
+		unsigned char * bufferPtr = (unsigned char*)result.data();
+		AesBackend::current()->encrypt(bufferPtr, bufferPtr, paddedSize);
+	}
+	return result;
 }
 
-template <int intSize>
-static QString streamAutoReadString(QIODevice * inStream, bool useXor, int * outLength = nullptr)
-{
-	int length = streamRead<QIntegerForSize<intSize>::Signed>(inStream);
-	QString result = streamReadString(inStream, length);
-	if(useXor)
-		xor ((quint8*)result.data(), result.length() * 2);
-	if (outLength)
-		*outLength = result.length();
-	return result;
+enum XmlConvertStatus
+{
+	XmlBin2TextConverted,
+	XmlText2BinConverted,
+	XmlConvertSkipped,
+	XmlConvertFailed,
+};
+
+struct XmlConvertTask
+{
+	QString filePath;
+	XmlConvertStatus status;
+	qint64 inputSize;
+	QString error;
+};
+
+static void convertXmlFile(XmlConvertTask & task)
+{
+	task.inputSize = 0;
+	QFile file(task.filePath);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		task.status = XmlConvertFailed;
+		task.error = file.errorString();
+		return;
+	}
+	const QByteArray bytes = file.readAll();
+	file.close();
+	task.inputSize = bytes.size();
+
+	QByteArray result;
+	if (bytes.startsWith("<?xml"))
+	{
+		task.status = XmlText2BinConverted;
+		result = BnsTool::xmlText2Bin(bytes);
+	}
+	else if (bytes.startsWith("LMXBOSLB"))
+	{
+		task.status = XmlBin2TextConverted;
+		result = BnsTool::xmlBin2Text(bytes);
+	}
+	else
+	{
+		task.status = XmlConvertSkipped;
+		return;
+	}
+	if (result.isEmpty())
+	{
+		task.status = XmlConvertFailed;
+		task.error = "convert failed";
+		return;
+	}
+
+	// an interrupted run leaves either the old or the new file, never a truncated one
+	QSaveFile saveFile(task.filePath);
+	if (!saveFile.open(QIODevice::WriteOnly) || saveFile.write(result) != result.size() || !saveFile.commit())
+	{
+		task.status = XmlConvertFailed;
+		task.error = saveFile.errorString();
+	}
 }
 
-static bool streamWriteString(QIODevice * outStream, const QString & str)
+static QStringList expandXmlPaths(const QStringList & paths, int threadCount)
 {
-	const int bytesToWrite = str.length() * 2;
-	return bytesToWrite == outStream->write((const char*)str.data(), bytesToWrite);
+	QStringList filePaths;
+	for (const QString & path : paths)
+	{
+		const QFileInfo fileInfo(path);
+		if (fileInfo.isDir())
+		{
+			const QDir dir(path);
+			for (const ScannedFile & scannedFile : scanFiles(dir, threadCount))
+			{
+				if (scannedFile.relativeFilePath.endsWith(".xml", Qt::CaseInsensitive))
+					filePaths.append(dir.filePath(scannedFile.relativeFilePath));
+			}
+		}
+		else if (fileInfo.fileName().contains('*') || fileInfo.fileName().contains('?') || fileInfo.fileName().contains('['))
+		{
+			const QDir dir = fileInfo.dir();
+			const QStringList fileNames = dir.entryList(QStringList(fileInfo.fileName()), QDir::Files, QDir::Name | QDir::IgnoreCase);
+			if (fileNames.isEmpty())
+				printLine(QString("Warning! no file matches %1").arg(path));
+			for (const QString & fileName : fileNames)
+				filePaths.append(dir.filePath(fileName));
+		}
+		else
+		{
+			filePaths.append(path);
+		}
+	}
+	return filePaths;
 }
 
-template <int intSize>
-static bool streamAutoWriteString(QIODevice * outStream, const QString & str, bool useXor)
+bool BnsTool::xmlAutoConvert(const QStringList & paths, const ConvertOptions & options)
 {
-	const int length = str.length();
-	if (!streamWrite<QIntegerForSize<intSize>::Signed>(outStream, length))
-		return false;
-	const int bytesToWrite = length * 2;
-	int bytesWritten = 0;
-	if (useXor)
+	const int threadCount = resolveThreadCount(options.threadCount);
+	QVector<XmlConvertTask> tasks;
+	for (const QString & filePath : expandXmlPaths(paths, threadCount))
 	{
-		QByteArray temp((const char*)str.data(), bytesToWrite);
-		xor ((quint8*)temp.data(), bytesToWrite);
-		bytesWritten = outStream->write(temp.data(), bytesToWrite);
+		XmlConvertTask task;
+		task.filePath = filePath;
+		tasks.append(task);
 	}
-	else
+	if (tasks.isEmpty())
 	{
-		bytesWritten = outStream->write((const char*)str.data(), bytesToWrite);
+		printLine("No xml file found");
+		return false;
 	}
-	return bytesWritten == bytesToWrite;
-}
+	printLine(QString("Converting %1 files").arg(tasks.size()));
 
-template <int intSize>
-bool extract(QFile * inFile, QDir outDir, bool convertXml)
-{
-	typedef typename QIntegerForSize<intSize>::Signed qintX;
+	QElapsedTimer timer;
+	timer.start();
+	QThreadPool::globalInstance()->setMaxThreadCount(threadCount);
+	QtConcurrent::blockingMap(tasks, convertXmlFile);
+	const double seconds = qMax<qint64>(timer.nsecsElapsed(), 1) / 1e9;
 
-	if (!inFile)
-		return false;
-	printLine(QString("Extracting %1 to %2").arg(inFile->fileName()).arg(outDir.path()));
+	int statusCounts[XmlConvertFailed + 1] = { 0 };
+	qint64 totalInputSize = 0;
+	for (const XmlConvertTask & task : tasks)
+	{
+		statusCounts[task.status]++;
+		totalInputSize += task.inputSize;
+		if (task.status == XmlConvertFailed)
+			printLine(QString("Error! %1 %2").arg(task.filePath).arg(task.error));
+		else if (task.status == XmlConvertSkipped)
+			printLine(QString("Warning! %1 is not a xml file, skipped").arg(task.filePath));
+	}
+
+	const int convertedCount = statusCounts[XmlBin2TextConverted] + statusCounts[XmlText2BinConverted];
+	printLine(QString("Converted %1 files (%2 bin to text, %3 text to bin), %4 skipped, %5 failed")
+		.arg(convertedCount).arg(statusCounts[XmlBin2TextConverted]).arg(statusCounts[XmlText2BinConverted])
+		.arg(statusCounts[XmlConvertSkipped]).arg(statusCounts[XmlConvertFailed]));
+	printLine(QString("%1 MB in %2 s, %3 MB/s, %4 files/s")
+		.arg(totalInputSize / 1048576.0, 0, 'f', 1).arg(seconds, 0, 'f', 2)
+		.arg(totalInputSize / 1048576.0 / seconds, 0, 'f', 1).arg(tasks.size() / seconds, 0, 'f', 0));
+	return statusCounts[XmlConvertFailed] == 0;
+}
 
-	if (!inFile->isOpen())
-		inFile->open(QIODevice::ReadOnly);
-	if (!inFile->isOpen())
+bool BnsTool::xmlPatchFile(const QString & inFileName, const QString & outFileName, const XmlPatch & xmlPatch)
+{
+	const QString targetFileName = outFileName.isEmpty() ? inFileName : outFileName;
+	printLine(QString("Patching %1 to %2").arg(inFileName).arg(targetFileName));
+	QFile file(inFileName);
+	if (!file.open(QIODevice::ReadOnly))
 	{
 		printLine("Error! file open failed");
 		return false;
 	}
-	inFile->seek(0);
-
-	if (!outDir.exists())
-		outDir.mkdir(".");
-
-	DatFileHeader<intSize> header = { 0 };
-	inFile->read((char*)&header, sizeof(header));
-	if (inFile->atEnd())
+	const QByteArray bytes = file.readAll();
+	file.close();
+	if (!bytes.startsWith("LMXBOSLB"))
+	{
+		printLine("Error! not a binary xml file");
 		return false;
+	}
 
-	if (!header.check())
+	const XmlPatch selectedPatch = xmlPatch.select(inFileName);
+	QByteArray patchedBytes;
+	int changeCount = 0;
+	if (!selectedPatch.apply(bytes, patchedBytes, changeCount))
 	{
-		printLine(QString("Error! corrupted header"));
+		printLine("Error patching");
 		return false;
 	}
 
-	const QByteArray packedFileTable = inFile->read(header.packedFileTableSize);
-	const qintX dataBeginPos = streamRead<qintX>(inFile);
-	if (dataBeginPos != inFile->pos())
-		printLine(QString("Warning! error data begin position at %1").arg(inFile->pos() - intSize));
-
-	QByteArray fileTable = BnsTool::unpack(packedFileTable, header.unpackedFileTableSize, header.isEncrypted, header.isCompressed);
-
-	QBuffer fileTableStream(&fileTable);
-	fileTableStream.open(QIODevice::ReadOnly);
-
-	int actualTotalFileIntermediateSize = 0;
-	for (int i = 0; i < header.fileCount; ++i)
+	// an unchanged file is only rewritten when it goes to another path
+	if (changeCount > 0 || targetFileName != inFileName)
 	{
-		if(fileTableStream.atEnd())
-			break;
-
-		QString relativeFilePath = streamAutoReadString<intSize>(&fileTableStream, false);
-		DatFileTableItem<intSize> fileItem = { 0 };
-		fileTableStream.read((char*)&fileItem, sizeof(fileItem));
-
-		actualTotalFileIntermediateSize += fileItem.intermediateSize;
-
-		printLine(QString("%1 / %2  %3").arg(i + 1).arg(header.fileCount).arg(relativeFilePath));
-
-		inFile->seek(dataBeginPos + fileItem.dataOffset);
-		QByteArray storedPackedFile = inFile->read(fileItem.packedSize);
-		QByteArray unpackedFile = BnsTool::unpack(storedPackedFile, fileItem.unpackedSize, fileItem.isEncrypted, fileItem.isCompressed);
-
-		if (convertXml && relativeFilePath.endsWith(".xml", Qt::CaseInsensitive) && unpackedFile.startsWith("LMXBOSLB"))
-			unpackedFile = BnsTool::xmlBin2Text(unpackedFile);
-
-		QString physicalFilePath = outDir.filePath(relativeFilePath);
-		QDir fileDir = QFileInfo(physicalFilePath).dir();
-		if (!fileDir.exists())
-			fileDir.mkpath(".");
-		
-		QFile file(physicalFilePath);
-		if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
-			file.write(unpackedFile);
-		else
-			printLine(QString("Warning! file %1 open failed").arg(relativeFilePath));
+		QSaveFile saveFile(targetFileName);
+		if (!saveFile.open(QIODevice::WriteOnly) || saveFile.write(patchedBytes) != patchedBytes.size() || !saveFile.commit())
+		{
+			printLine(QString("Error! writing %1 failed").arg(targetFileName));
+			return false;
+		}
 	}
-
-	if(actualTotalFileIntermediateSize != header.totalFileIntermediateSize)
-		printLine(QString("Warning! error recorded sum size"));
-
-	printLine("Extract finished");
-
+	printLine(QString("Patch finished, %1 changes").arg(changeCount));
 	return true;
 }
 
-template <int intSize>
-bool compress(QDir inDir, QFile * outFile)
+// Reads the binary xml node stream in place. Tag names and attribute keys repeat across every record
+// of a file, so they are decoded through an intern table.
+class BinXmlReader
 {
-	typedef typename QIntegerForSize<intSize>::Signed qintX;
-
-	if (!outFile)
-		return false;
-	printLine(QString("Compressing %1 to %2").arg(inDir.path()).arg(outFile->fileName()));
-
-	if (!outFile->isOpen())
-		outFile->open(QIODevice::WriteOnly);
-	if (!outFile->isOpen())
+public:
+	BinXmlReader(const char * begin, const char * end)
+		: pos(begin), end(end), isFailed(false)
 	{
-		printLine("Error! file open failed");
-		return false;
 	}
-	outFile->seek(0);
 
-	QFileInfoList fileInfoList = recursiveFindFile(inDir);
-	
-	DatFileHeader<intSize> header;
-	header.init();
-	header.fileCount = fileInfoList.size();
-	header.isCompressed = true;
-	header.isEncrypted = true;
-
-	QBuffer fileTableStream;
-	QBuffer fileDataStream;
-
-	fileTableStream.open(QIODevice::WriteOnly);
-	fileDataStream.open(QIODevice::WriteOnly);
-
-	for(int i = 0; i < fileInfoList.size(); ++i)
+	bool failed() const
 	{
-		const QFileInfo & fileInfo = fileInfoList.at(i);
-		const QString physicalFilePath = fileInfo.filePath();
-		const QString relativeFilePath = inDir.relativeFilePath(fileInfo.absoluteFilePath()).replace("/", "\\");
-		printLine(QString("%1 / %2  %3").arg(i + 1).arg(header.fileCount).arg(relativeFilePath));
+		return isFailed;
+	}
 
-		QFile file(physicalFilePath);
-		if (!file.open(QIODevice::ReadOnly))
+	template <class T>
+	T read()
+	{
+		T value = T();
+		if (end - pos < (qint64)sizeof(T))
 		{
-			printLine(QString("Warning! file %1 open failed").arg(relativeFilePath));
-			continue;
+			isFailed = true;
+			pos = end;
+			return value;
 		}
-		QByteArray fileData = file.readAll();
-		file.close();
-
-		if (relativeFilePath.endsWith(".xml", Qt::CaseInsensitive) && fileData.startsWith("<?xml"))
-			fileData = BnsTool::xmlText2Bin(fileData);
-
-		qint32 intermediateCompressedSize = 0;
-		QByteArray packedFileData = BnsTool::pack(fileData, true, true, &intermediateCompressedSize);
-
-		DatFileTableItem<intSize> fileItem = { 0 };
-		fileItem.unknown1 = 2;
-		fileItem.isCompressed = true;
-		fileItem.isEncrypted = true;
-		fileItem.unpackedSize = fileData.size();
-		fileItem.intermediateSize = intermediateCompressedSize;
-		fileItem.packedSize = packedFileData.size();
-		fileItem.dataOffset = fileDataStream.pos();
-
-		streamAutoWriteString<intSize>(&fileTableStream, relativeFilePath, false);
-		fileTableStream.write((const char*)&fileItem, sizeof(fileItem));
-
-		fileDataStream.write(packedFileData);
-
-		header.totalFileIntermediateSize += intermediateCompressedSize;
+		memcpy(&value, pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
 	}
 
-	fileTableStream.close();
-	fileDataStream.close();
-
-	QByteArray fileTable = fileTableStream.data();
-	QByteArray packedFileTable = BnsTool::pack(fileTable, true, true);
-	QByteArray fileData = fileDataStream.data();
-	
-	header.unpackedFileTableSize = fileTable.size();
-	header.packedFileTableSize = packedFileTable.size();
+	QString readString()
+	{
+		return readXorString(false);
+	}
 
-	fileTable.clear();
-	fileTableStream.setData(QByteArray());
-	fileDataStream.setData(QByteArray());
+	QString readName()
+	{
+		return readXorString(true);
+	}
 
-	outFile->write((const char*)&header, sizeof(header));
-	outFile->write(packedFileTable);
-	streamWrite<qintX>(outFile, (qintX)(sizeof(header) + packedFileTable.size() + intSize));
-	outFile->write(fileData);
+private:
+	QString readXorString(bool isName)
+	{
+		const qint32 length = read<qint32>();
+		if (length < 0 || (end - pos) / 2 < length)
+		{
+			isFailed = true;
+			pos = end;
+			return QString();
+		}
+		const QString result = isName ? names.decode(pos, length) : decodeXorString(pos, length);
+		pos += length * 2;
+		return result;
+	}
 
-	printLine(QString("Compress finished, %1 bytes").arg(outFile->size()));
-	return true;
-}
+	const char * pos;
+	const char * end;
+	bool isFailed;
+	XorStringInternTable names;
+};
 
-bool BnsTool::extract(QFile * inFile, QDir outDir, bool convertXml)
+// Writes indented UTF-8 xml the way QDomDocument::toByteArray(2) lays it out, without building a DOM.
+// Whether a newline follows a node depends on its next sibling being text, so every element and comment
+// leaves a pending newline that the next node or the closing tag of the parent resolves.
+class TextXmlWriter
 {
-	return ::extract<4>(inFile, outDir, convertXml);
-}
+public:
+	enum Escaping
+	{
+		NoEscaping,
+		TextEscaping,
+		AttributeEscaping,
+	};
 
-bool BnsTool::extract64(QFile * inFile, QDir outDir, bool convertXml)
-{
-	return ::extract<8>(inFile, outDir, convertXml);
-}
+	explicit TextXmlWriter(QIODevice * outStream)
+		: outStream(outStream), isTagOpen(false), isNewlinePending(false), isFailed(false)
+	{
+		buffer.reserve(FlushSize + 1024);
+	}
 
-bool BnsTool::compress(QDir inDir, QFile * outFile)
-{
-	return ::compress<4>(inDir, outFile);
-}
+	bool finish()
+	{
+		resolvePendingNewline(false);
+		flush();
+		return !isFailed;
+	}
 
-bool BnsTool::compress64(QDir inDir, QFile * outFile)
-{
-	return ::compress<8>(inDir, outFile);
-}
+	void writeDeclaration()
+	{
+		append("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
+	}
 
-QByteArray BnsTool::unpack(QByteArray bytes, qint32 unpackedSize, bool isEncrypted, bool isCompressed)
-{
-	QByteArray result;
-	const int headerSize = isCompressed ? 4 : 0;
-	if (isEncrypted)
+	void beginElement(const QString & tagName, const QVector<QPair<QString, QString>> & attributes, int depth, bool isPrevSiblingText)
 	{
-		const int paddedSize = getPaddedSize(bytes.size(), AES_BLOCK_SIZE);
-		result.resize(headerSize + paddedSize);
-		memcpy(result.data() + headerSize, bytes.data(), bytes.size());
-		memset(result.data() + headerSize + bytes.size(), 0, paddedSize - bytes.size());
-		for (int i = 0; i < paddedSize; i += AES_BLOCK_SIZE)
+		beginNode(false, depth, isPrevSiblingText);
+		buffer += '<';
+		append(tagName, NoEscaping);
+		for (const QPair<QString, QString> & attribute : attributes)
 		{
-			unsigned char * bufferPtr = (unsigned char*)(result.data() + headerSize + i);
-			AES_decrypt(bufferPtr, bufferPtr, &aesDecryptKey);
+			buffer += ' ';
+			append(attribute.first, NoEscaping);
+			buffer += "=\"";
+			append(attribute.second, AttributeEscaping);
+			buffer += '"';
 		}
+		isTagOpen = true;
 	}
-	else
+
+	void endElement(const QString & tagName, int depth, bool isLastChildText)
 	{
-		if (headerSize > 0)
-			result = QByteArray(headerSize, '\0') + bytes;
+		if (isTagOpen)
+		{
+			buffer += "/>";
+			isTagOpen = false;
+		}
 		else
-			result = bytes;
+		{
+			resolvePendingNewline(false);
+			if (!isLastChildText)
+				appendIndent(depth);
+			buffer += "</";
+			append(tagName, NoEscaping);
+			buffer += '>';
+		}
+		isNewlinePending = true;
+		flushIfFull();
 	}
 
-	if (isCompressed)
+	void writeText(const QString & text, int depth, bool isPrevSiblingText)
 	{
-		*(qint32*)result.data() = qToBigEndian(unpackedSize);
-		result = qUncompress(result);
+		beginNode(true, depth, isPrevSiblingText);
+		append(text, TextEscaping);
+		flushIfFull();
 	}
 
-	return result;
-}
+	void writeComment(const QString & comment, int depth, bool isPrevSiblingText)
+	{
+		beginNode(false, depth, isPrevSiblingText);
+		buffer += "<!--";
+		append(comment, NoEscaping);
+		if (comment.endsWith('-'))
+			buffer += ' ';
+		buffer += "-->";
+		isNewlinePending = true;
+	}
 
-QByteArray BnsTool::pack(QByteArray bytes, bool isEncrypted, bool isCompressed, qint32 * outIntermediateCompressedSize)
-{
-	QByteArray result;
-	int headerSize = 0;
-	if (isCompressed)
+private:
+	static const int FlushSize = 64 * 1024;
+
+	void beginNode(bool isText, int depth, bool isPrevSiblingText)
 	{
-		result = qCompress(bytes);
-		headerSize = 4;
+		if (isTagOpen)
+		{
+			buffer += '>';
+			isTagOpen = false;
+			isNewlinePending = true;
+		}
+		resolvePendingNewline(isText);
+		if (!isText && !isPrevSiblingText)
+			appendIndent(depth);
 	}
-	else
+
+	void resolvePendingNewline(bool isNextText)
 	{
-		result = bytes;
+		if (isNewlinePending && !isNextText)
+			buffer += '\n';
+		isNewlinePending = false;
 	}
 
-	if (outIntermediateCompressedSize)
-		*outIntermediateCompressedSize = result.size() - headerSize;
+	void appendIndent(int depth)
+	{
+		buffer.append(depth * 2, ' ');
+	}
 
-	if (isEncrypted)
+	void append(const char * str)
+	{
+		buffer += str;
+	}
+
+	// Same escapes as QDom's encodeText(), attribute values additionally escape quotes, tabs and newlines.
+	void append(const QString & str, Escaping escaping)
 	{
-		const int actualSize = result.size() - headerSize;
-		const int paddedSize = getPaddedSize(actualSize, AES_BLOCK_SIZE);
-		if (result.size() < paddedSize + headerSize)
-			result += QByteArray(paddedSize + headerSize - result.size(), '\0');
-		
-		for (int i = 0; i < paddedSize; i += AES_BLOCK_SIZE)
+		const ushort * text = str.utf16();
+		const int length = str.length();
+		for (int i = 0; i < length; ++i)
 		{
-			unsigned char * inPtr = (unsigned char*)(result.data() + headerSize + i);
-			unsigned char * outPtr = (unsigned char*)(result.data() + i);
-			AES_encrypt(inPtr, outPtr, &aesEncryptKey);
+			const ushort c = text[i];
+			if (c < 0x80)
+			{
+				if (escaping == NoEscaping)
+					buffer += (char)c;
+				else if (c == '<')
+					buffer += "&lt;";
+				else if (c == '&')
+					buffer += "&amp;";
+				else if (c == '>' && i >= 2 && text[i - 1] == ']' && text[i - 2] == ']')
+					buffer += "&gt;";
+				else if (c == '\r')
+					buffer += "&#xd;";
+				else if (escaping == AttributeEscaping && c == '"')
+					buffer += "&quot;";
+				else if (escaping == AttributeEscaping && c == '\n')
+					buffer += "&#xa;";
+				else if (escaping == AttributeEscaping && c == '\t')
+					buffer += "&#x9;";
+				else
+					buffer += (char)c;
+			}
+			else if (c < 0x800)
+			{
+				buffer += (char)(0xC0 | (c >> 6));
+				buffer += (char)(0x80 | (c & 0x3F));
+			}
+			else if (QChar::isHighSurrogate(c) && i + 1 < length && QChar::isLowSurrogate(text[i + 1]))
+			{
+				const uint ucs4 = QChar::surrogateToUcs4(c, text[++i]);
+				buffer += (char)(0xF0 | (ucs4 >> 18));
+				buffer += (char)(0x80 | ((ucs4 >> 12) & 0x3F));
+				buffer += (char)(0x80 | ((ucs4 >> 6) & 0x3F));
+				buffer += (char)(0x80 | (ucs4 & 0x3F));
+			}
+			else if (QChar::isSurrogate(c))
+			{
+				buffer += QString(QChar(c)).toUtf8();
+			}
+			else
+			{
+				buffer += (char)(0xE0 | (c >> 12));
+				buffer += (char)(0x80 | ((c >> 6) & 0x3F));
+				buffer += (char)(0x80 | (c & 0x3F));
+			}
 		}
-		result.chop(headerSize);
-		headerSize = 0;
 	}
-	if (headerSize > 0)
+
+	void flushIfFull()
 	{
-		result.remove(0, headerSize);
-		headerSize = 0;
+		if (buffer.size() >= FlushSize)
+			flush();
 	}
-	return result;
-}
 
-bool BnsTool::xmlAutoConvert(QFile * file)
-{
-	if (!file)
-		return false;
-	printLine(QString("Auto converting %1").arg(file->fileName()));
-	if (!file->isOpen())
-		file->open(QIODevice::ReadWrite);
-	if (!file->isOpen())
+	void flush()
 	{
-		printLine("Error! file open failed");
-		return false;
+		if (buffer.size() > 0 && outStream->write(buffer) != buffer.size())
+			isFailed = true;
+		buffer.resize(0);
 	}
-	file->seek(0);
-	QByteArray header = file->read(8);
-	QByteArray bytes;
-	if(header.startsWith("<?xml"))
+
+	QIODevice * outStream;
+	QByteArray buffer;
+	bool isTagOpen;
+	bool isNewlinePending;
+	bool isFailed;
+};
+
+// Streams LMXBOSLB nodes from reader to writer, keeping only the nesting stack of the document.
+// Empty text nodes and everything below them or below text nodes are read but not written,
+// just like the DOM conversion used to drop them.
+static bool convertBinXmlNode(BinXmlReader & reader, TextXmlWriter * writer, int depth, bool isRoot, bool & isPrevSiblingText, const QString & rootComment = QString())
+{
+	const qint32 nodeType = isRoot ? 1 : reader.read<qint32>();
+	if (nodeType != 1 && nodeType != 2)
 	{
-		printLine("Text to bin");
-		file->seek(0);
-		bytes = xmlText2Bin(file->readAll());
+		printLine(QString("Error node type"));
+		return false;
 	}
-	else if (header.startsWith("LMXBOSLB"))
+
+	TextXmlWriter * childWriter = writer;
+	QString tagName;
+	if (nodeType == 1)
 	{
-		printLine("Bin to text");
-		file->seek(0);
-		bytes = xmlBin2Text(file->readAll());
+		QVector<QPair<QString, QString>> attributes;
+		const qint32 attributeCount = reader.read<qint32>();
+		for (int i = 0; i < attributeCount && !reader.failed(); ++i)
+		{
+			const QString key = reader.readName();
+			const QString value = reader.readString();
+			// a repeated key overwrites the value, as setAttribute() did
+			int index = 0;
+			while (index < attributes.size() && attributes.at(index).first != key)
+				++index;
+			if (index < attributes.size())
+				attributes[index].second = value;
+			else
+				attributes.append(qMakePair(key, value));
+		}
+		reader.read<quint8>();
+		tagName = reader.readName();
+		if (writer && !reader.failed())
+		{
+			writer->beginElement(tagName, attributes, depth, isPrevSiblingText);
+			isPrevSiblingText = false;
+		}
 	}
 	else
 	{
-		printLine("Unknown file type");
-		return false;
+		const QString text = reader.readString();
+		reader.read<quint8>();
+		reader.readName();
+		if (writer && !reader.failed() && text.trimmed().length() > 0)
+		{
+			writer->writeText(text, depth, isPrevSiblingText);
+			isPrevSiblingText = true;
+		}
+		childWriter = nullptr;
 	}
 
-	if (bytes.size() > 0)
+	const qint32 childNodeCount = reader.read<qint32>();
+	reader.read<qint32>();		// autoId
+
+	bool isPrevChildText = false;
+	if (childWriter && isRoot)
+		childWriter->writeComment(rootComment, depth + 1, isPrevChildText);
+	for (int i = 0; i < childNodeCount && !reader.failed(); ++i)
 	{
-		file->seek(0);
-		file->write(bytes);
-		file->resize(bytes.size());
-		printLine(QString("Convert finished %1 bytes").arg(bytes.size()));
-		return true;
+		if (!convertBinXmlNode(reader, childWriter, depth + 1, false, isPrevChildText))
+			return false;
 	}
-	else
+
+	if (reader.failed())
 	{
-		printLine("Error converting");
+		printLine(QString("Error unexpected end of binary xml"));
 		return false;
 	}
+
+	if (nodeType == 1 && writer)
+		writer->endElement(tagName, depth, isPrevChildText);
+	return true;
 }
 
-QByteArray BnsTool::xmlBin2Text(QByteArray bytes)
+bool BnsTool::xmlBin2Text(const QByteArray & bytes, QIODevice * outStream)
 {
-	QBuffer stream(&bytes);
-	stream.open(QIODevice::ReadOnly);
-	BinXmlHeader header = { 0 };
-	stream.read((char*)&header, sizeof(header));
-
-	if (stream.atEnd())
-		return QByteArray();
-
-	QString originalFilePath = streamAutoReadString<4>(&stream, true);
-
-	QDomDocument document;
-	QDomProcessingInstruction processingInstruction = document.createProcessingInstruction("xml version=\"1.0\"", "encoding=\"utf-8\"");
-	QDomComment commentNode = document.createComment(originalFilePath);
-	QDomNode rootNode = parseBinXml(&stream, document);
+	StatsTimer statsTimer(Stats::XmlBin2TextStage, bytes.size());
+	if (bytes.size() <= (int)sizeof(BinXmlHeader))
+		return false;
 
-	rootNode.insertBefore(commentNode, rootNode.firstChild());
+	BinXmlReader reader(bytes.constData() + sizeof(BinXmlHeader), bytes.constData() + bytes.size());
+	const QString originalFilePath = reader.readString();
 
-	document.appendChild(processingInstruction);
-	document.appendChild(rootNode);
+	TextXmlWriter writer(outStream);
+	writer.writeDeclaration();
+	bool isPrevSiblingText = false;
+	if (!convertBinXmlNode(reader, &writer, 0, true, isPrevSiblingText, originalFilePath))
+		return false;
+	return writer.finish();
+}
 
-	return document.toByteArray(2);
+QByteArray BnsTool::xmlBin2Text(QByteArray bytes)
+{
+	QByteArray result;
+	QBuffer stream(&result);
+	stream.open(QIODevice::WriteOnly);
+	if (!xmlBin2Text(bytes, &stream))
+		return QByteArray();
+	stream.close();
+	return result;
 }
 
-QByteArray BnsTool::xmlText2Bin(QByteArray bytes)
+
+// Appends the binary xml node stream to a single growable buffer.
+class BinXmlWriter
 {
-	QDomDocument document;
-	QString errorMsg;
-	if (!document.setContent(bytes, &errorMsg))
+public:
+	BinXmlWriter(int reservedSize)
 	{
-		printLine(QString("Error parsing xml \"%1\"").arg(errorMsg));
-		return QByteArray();
+		buffer.reserve(reservedSize);
 	}
 
-	QString originalFilePath;
-	
-	QDomElement rootNode = document.documentElement();
-	const QDomNode firstChildNode = rootNode.firstChild();
-	if (firstChildNode.nodeType() == QDomNode::CommentNode)
+	int pos() const
 	{
-		originalFilePath = firstChildNode.nodeValue();
-		rootNode.removeChild(firstChildNode);
+		return buffer.size();
 	}
-	else
+
+	QByteArray & data()
 	{
-		printLine(QString("Warning! Xml no comment"));
+		return buffer;
 	}
 
-	QBuffer stream;
-	stream.open(QIODevice::WriteOnly);
-
-	BinXmlHeader header = { 0 };
-	stream.write((const char*)&header, sizeof(header));
-	streamAutoWriteString<4>(&stream, originalFilePath, true);
-	serializeBinXml(rootNode, &stream);
-
-	header.init();
-	header.fileSize = stream.size();
-	stream.seek(0);
-	stream.write((const char*)&header, sizeof(header));
-	stream.close();
-
-	return stream.data();
-}
-
-QDomNode BnsTool::parseBinXml(QIODevice * inStream, QDomDocument & document, bool isRoot)
-{
-	QDomNode node;
-	if (inStream->atEnd())
-		return node;
-
-	qint32 nodeType = 1;
-	if (!isRoot)
-		nodeType = streamRead<qint32>(inStream);
-	
-	if (nodeType != 1 && nodeType != 2)
+	template <class T>
+	void write(const T & value)
 	{
-		printLine(QString("Error node type"));
-		return node;
+		buffer.append((const char*)&value, sizeof(T));
 	}
 
-	if (nodeType == 1)
+	template <class T>
+	void writeAt(int pos, const T & value)
 	{
-		QDomElement elementNode = document.createElement("tempName");
-		const qint32 attributeCount = streamRead<qint32>(inStream);
-		for (int i = 0; i < attributeCount; ++i)
-		{
-			const QString key = streamAutoReadString<4>(inStream, true);
-			const QString value = streamAutoReadString<4>(inStream, true);
-			elementNode.setAttribute(key, value);
-		}
-		quint8 unknown1 = streamRead<quint8>(inStream);
-		const QString tagName = streamAutoReadString<4>(inStream, true);
-		elementNode.setTagName(tagName);
-		node = elementNode;
+		memcpy(buffer.data() + pos, &value, sizeof(T));
 	}
-	else if (nodeType == 2)
+
+	void writeString(const QString & str)
 	{
-		QDomText textNode = document.createTextNode("tempName");
-		QString text = streamAutoReadString<4>(inStream, true);
-		quint8 unknown1 = streamRead<quint8>(inStream);
-		const QString tagName = streamAutoReadString<4>(inStream, true);
-		if (text.trimmed().length() > 0)
-		{
-			textNode.setData(text);
-			node = textNode;
-		}
+		const int length = str.length();
+		write<qint32>(length);
+		appendXorString(buffer, str);
 	}
 
-	const qint32 childNodeCount = streamRead<qint32>(inStream);
-	const qint32 autoId = streamRead<qint32>(inStream);
+private:
+	QByteArray buffer;
+};
 
-	for (int i = 0; i < childNodeCount; ++i)
+static bool isXmlWhitespace(const QString & text)
+{
+	for (const QChar c : text)
 	{
-		const QDomNode childNode = parseBinXml(inStream, document, false);
-		if (!childNode.isNull())
-			node.appendChild(childNode);
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+			return false;
 	}
+	return true;
+}
 
-	return node;
+// Serializes one element header. The child count is a placeholder that is backpatched when the element ends,
+// autoId is depth + 1 because the DOM serializer handed the same id to every sibling.
+static int writeBinXmlElement(BinXmlWriter & writer, const QString & tagName, const QXmlStreamAttributes & attributes, int depth)
+{
+	if (depth > 0)
+		writer.write<qint32>(1);
+	writer.write<qint32>(attributes.size());
+	for (const QXmlStreamAttribute & attribute : attributes)
+	{
+		writer.writeString(attribute.qualifiedName().toString());
+		writer.writeString(attribute.value().toString());
+	}
+	writer.write<quint8>(1);
+	writer.writeString(tagName);
+	const int childNodeCountPos = writer.pos();
+	writer.write<quint32>(0);
+	writer.write<quint32>(depth + 1);
+	return childNodeCountPos;
 }
 
-bool BnsTool::serializeBinXml(QDomNode node, QIODevice * outStream, bool isRoot, int beginAutoId, int * outEndAutoId)
+static void writeBinXmlText(BinXmlWriter & writer, const QString & text, int depth)
 {
-	QDomNode::NodeType nodeType = node.nodeType();
-	QString tagName;
-	if (nodeType == QDomNode::ElementNode)
+	writer.write<qint32>(2);
+	writer.writeString(text);
+	writer.write<quint8>(1);
+	writer.writeString("text");
+	writer.write<quint32>(0);
+	writer.write<quint32>(depth + 1);
+}
+
+QByteArray BnsTool::xmlText2Bin(QByteArray bytes)
+{
+	StatsTimer statsTimer(Stats::XmlText2BinStage, bytes.size());
+	struct OpenElement
+	{
+		int childNodeCountPos;
+		quint32 childNodeCount;
+	};
+
+	QXmlStreamReader reader(bytes);
+	reader.setNamespaceProcessing(false);
+
+	BinXmlWriter writer(bytes.size() * 2);
+	BinXmlHeader header = { 0 };
+	writer.write(header);
+
+	QVector<OpenElement> openElements;
+	QString pendingText;
+
+	// The root element is written once the node after its start tag shows whether it is the comment
+	// holding the original file path, which precedes the root in the binary format.
+	bool isRootPending = false;
+	QString rootTagName;
+	QXmlStreamAttributes rootAttributes;
+	auto writeRoot = [&](const QString & originalFilePath)
+	{
+		writer.writeString(originalFilePath);
+		OpenElement rootElement = { writeBinXmlElement(writer, rootTagName, rootAttributes, 0), 0 };
+		openElements.append(rootElement);
+		isRootPending = false;
+	};
+	auto writeRootWithoutComment = [&]()
 	{
-		if (!isRoot)
-			streamWrite<qint32>(outStream, 1);
-		const QDomElement elementNode = node.toElement();
-		const QDomNamedNodeMap attributes = elementNode.attributes();
-		streamWrite<qint32>(outStream, attributes.count());
-		for (int i = 0; i < attributes.count(); ++i)
+		printLine(QString("Warning! Xml no comment"));
+		writeRoot(QString());
+	};
+
+	while (!reader.atEnd())
+	{
+		const QXmlStreamReader::TokenType tokenType = reader.readNext();
+		if (tokenType == QXmlStreamReader::Characters)
 		{
-			const QDomAttr attrNode = attributes.item(i).toAttr();
-			streamAutoWriteString<4>(outStream, attrNode.name(), true);
-			streamAutoWriteString<4>(outStream, attrNode.value(), true);
+			pendingText += reader.text();
+			continue;
+		}
+
+		// adjacent character tokens form one text node, whitespace only text is dropped like the DOM parser did
+		if (!pendingText.isEmpty())
+		{
+			if (!isXmlWhitespace(pendingText))
+			{
+				if (isRootPending)
+					writeRootWithoutComment();
+				if (!openElements.isEmpty())
+				{
+					writeBinXmlText(writer, pendingText, openElements.size());
+					openElements.last().childNodeCount++;
+				}
+			}
+			pendingText.clear();
+		}
+
+		if (tokenType == QXmlStreamReader::StartElement)
+		{
+			if (isRootPending)
+				writeRootWithoutComment();
+			if (openElements.isEmpty())
+			{
+				isRootPending = true;
+				rootTagName = reader.qualifiedName().toString();
+				rootAttributes = reader.attributes();
+			}
+			else
+			{
+				openElements.last().childNodeCount++;
+				OpenElement element = { writeBinXmlElement(writer, reader.qualifiedName().toString(), reader.attributes(), openElements.size()), 0 };
+				openElements.append(element);
+			}
+		}
+		else if (tokenType == QXmlStreamReader::EndElement)
+		{
+			if (isRootPending)
+				writeRootWithoutComment();
+			const OpenElement element = openElements.takeLast();
+			writer.writeAt<quint32>(element.childNodeCountPos, element.childNodeCount);
+		}
+		else if (tokenType == QXmlStreamReader::Comment)
+		{
+			if (isRootPending)
+				writeRoot(reader.text().toString());
+			else if (!openElements.isEmpty())
+				printLine(QString("Warning! comment at line %1 skipped").arg(reader.lineNumber()));
 		}
-		tagName = elementNode.tagName();
-	}
-	else if (nodeType == QDomNode::TextNode)
-	{
-		if (!isRoot)
-			streamWrite<qint32>(outStream, 2);
-		const QDomText textNode = node.toText();
-		const QString text = textNode.nodeValue();
-		streamAutoWriteString<4>(outStream, text, true);
-		tagName = "text";
 	}
-	else
+
+	if (reader.hasError())
 	{
-		printLine(QString("Unsupported node type at line %1").arg(node.lineNumber()));
-		return false;
+		printLine(QString("Error parsing xml \"%1\"").arg(reader.errorString()));
+		return QByteArray();
 	}
-	QDomNodeList childNodeList = node.childNodes();
 
-	int autoId = beginAutoId;
-
-	streamWrite<quint8>(outStream, 1);
-	streamAutoWriteString<4>(outStream, tagName, true);
-	streamWrite<quint32>(outStream, childNodeList.size());
-	streamWrite<quint32>(outStream, autoId);
+	header.init();
+	header.fileSize = writer.pos();
+	writer.writeAt(0, header);
 
-	autoId++;
-	for(int i = 0; i < childNodeList.size(); ++i)
-		serializeBinXml(childNodeList.at(i), outStream, false, autoId, &autoId);
-	
-	return true;
-}
\ No newline at end of file
+	return writer.data();
+}
@@ -1,25 +1,104 @@
 #pragma once
 #include <QFile>
 #include <QDir>
-#include <QDomNode>
+
+class XmlPatch;
 
 class BnsTool
 {
 public:
-	static bool extract(QFile * inFile, QDir outDir, bool convertXml);
-	static bool extract64(QFile * inFile, QDir outDir, bool convertXml);
-	static bool compress(QDir inDir, QFile * outFile);
-	static bool compress64(QDir inDir, QFile * outFile);
+	struct ExtractOptions
+	{
+		bool convertXml = false;
+		int threadCount = 1;
+		bool useFileMapping = true;
+		QStringList onlyPatterns;
+		// when set, the files are written to this device as a tar stream in table order instead of to outDir
+		QIODevice * tarOutput = nullptr;
+	};
+
+	static bool list(QFile * inFile);
+	static bool list64(QFile * inFile);
+	static bool extract(QFile * inFile, QDir outDir, const ExtractOptions & options);
+	static bool extract64(QFile * inFile, QDir outDir, const ExtractOptions & options);
+
+	enum CompressionLevel
+	{
+		StoreLevel,
+		FastLevel,
+		DefaultLevel,
+		MaxLevel,
+	};
+
+	static bool parseCompressionLevel(const QString & name, CompressionLevel & level);
+	static const char * compressionBackendName();
+
+	struct CompressOptions
+	{
+		int threadCount = 1;
+		bool streamOutput = false;
+		QString baseFileName;
+		QString cacheDirName;
+		qint64 maxCacheSize = 0;
+		// used for files that neither an override nor a built in file type default matches
+		CompressionLevel compressionLevel = DefaultLevel;
+		// wildcard path patterns, the first match wins and takes precedence over the file type defaults
+		QList<QPair<QString, CompressionLevel>> compressionLevelOverrides;
+		// files with identical content are packed once and their table items share the data
+		bool deduplicate = false;
+		// when set, the files are read from this tar stream and added in stream order instead of scanning inDir
+		QIODevice * tarInput = nullptr;
+	};
+
+	static bool compress(QDir inDir, QFile * outFile, const CompressOptions & options);
+	static bool compress64(QDir inDir, QFile * outFile, const CompressOptions & options);
+
+	struct PatchOptions
+	{
+		int threadCount = 1;
+		bool useFileMapping = true;
+	};
+
+	// Writes a copy of the dat to outFile with the rules applied to its binary xml entries,
+	// every other entry keeps its packed data.
+	static bool patch(QFile * inFile, QFile * outFile, const XmlPatch & xmlPatch, const PatchOptions & options);
+	static bool patch64(QFile * inFile, QFile * outFile, const XmlPatch & xmlPatch, const PatchOptions & options);
+
+	struct DiffOptions
+	{
+		int threadCount = 1;
+		bool useFileMapping = true;
+	};
+
+	// Writes the entries of target that differ from base into a delta dat, together with a manifest of the target table.
+	static bool diff(QFile * baseFile, QFile * targetFile, QFile * deltaFile, const DiffOptions & options);
+	static bool diff64(QFile * baseFile, QFile * targetFile, QFile * deltaFile, const DiffOptions & options);
+	// Rebuilds the target from base and delta, unchanged entries keep the packed data of base.
+	static bool apply(QFile * baseFile, QFile * deltaFile, QFile * outFile, const DiffOptions & options);
+	static bool apply64(QFile * baseFile, QFile * deltaFile, QFile * outFile, const DiffOptions & options);
+
+	// the largest entry pack and unpack handle, archives themselves may be larger when 64-bit
+	static const qint64 MaxEntrySize = 0x7FFFFFFF - 4096;
 
-	static QByteArray unpack(QByteArray bytes, qint32 unpackedSize, bool isEncrypted, bool isCompressed);
-	static QByteArray pack(QByteArray bytes, bool isEncrypted, bool isCompressed, qint32 * outIntermediateCompressedSize = nullptr);
+	static QByteArray unpack(const QByteArray & bytes, qint64 unpackedSize, bool isEncrypted, bool isCompressed);
+	// With outIsCompressed set, data that does not shrink is stored uncompressed and *outIsCompressed tells which way it went.
+	static QByteArray pack(QByteArray bytes, bool isEncrypted, bool isCompressed, qint32 * outIntermediateCompressedSize = nullptr,
+		CompressionLevel compressionLevel = DefaultLevel, bool * outIsCompressed = nullptr);
 
 	static QByteArray xmlBin2Text(QByteArray bytes);
+	static bool xmlBin2Text(const QByteArray & bytes, QIODevice * outStream);
 	static QByteArray xmlText2Bin(QByteArray bytes);
+	// part of the pack cache key, must be increased whenever xmlText2Bin produces different output
+	static const int XmlText2BinVersion = 1;
 
-	static bool xmlAutoConvert(QFile * file);
+	struct ConvertOptions
+	{
+		int threadCount = 1;
+	};
 
-private:
-	static QDomNode parseBinXml(QIODevice * inStream, QDomDocument & document, bool isRoot = true);
-	static bool serializeBinXml(QDomNode node, QIODevice * outStream, bool isRoot = true, int beginAutoId = 1, int * outEndAutoId = nullptr);
+	// Converts every file the paths name, concurrently. Directories are searched for *.xml recursively and
+	// wildcards are allowed in the file name part. Each file is replaced atomically through a temporary file.
+	static bool xmlAutoConvert(const QStringList & paths, const ConvertOptions & options);
+	// Patches a standalone binary xml file into outFileName, or atomically in place when outFileName is empty.
+	static bool xmlPatchFile(const QString & inFileName, const QString & outFileName, const XmlPatch & xmlPatch);
 };
\ No newline at end of file
@@ -0,0 +1,239 @@
+#pragma once
+#include <QBuffer>
+#include <QFile>
+#include <QString>
+#include <QVector>
+#include <cstring>
+#include "BnsTool.h"
+#include "Stats.h"
+#include "Util.h"
+#include "XorCodec.h"
+
+// On-disk layout of dat files and binary xml, and the helpers that read and write it. Dat files exist
+// in a 32-bit and a 64-bit flavour that only differ in the width of their integers, hence intSize.
+// A dat is the header, the packed file table, dataBeginPos and the data region. dataBeginPos usually
+// follows the table directly, streamed output may leave a zero filled gap in between.
+
+#pragma pack(push, 1)
+template<int intSize>
+struct DatFileTableItem
+{
+	typedef typename QIntegerForSize<intSize>::Signed qintX;
+
+	quint8 unknown1;
+	bool isCompressed;
+	bool isEncrypted;
+	quint8 unknown2;
+	qintX unpackedSize;
+	qintX intermediateSize;		// ѹǰĴСȡpackedSize
+	qintX packedSize;
+	qintX dataOffset;
+	quint8 padding[60];
+};
+
+template<int intSize>
+struct DatFileHeader
+{
+	typedef typename QIntegerForSize<intSize>::Signed qintX;
+
+	quint8 signature[8];
+	qint32 version;
+	quint8 unknown1[5];
+	qintX totalFileIntermediateSize;
+	qintX fileCount;
+	bool isCompressed;
+	bool isEncrypted;
+	quint8 unknown2[62];
+	qintX packedFileTableSize;
+	qintX unpackedFileTableSize;
+
+	void init()
+	{
+		memset(this, 0, sizeof(DatFileHeader));
+		memcpy(signature, "UOSEDALB", 8);
+		version = 2;
+	}
+
+	// There is no limit on fileCount, instead the table has to be large enough to hold fileCount entries.
+	// That also keeps a 64-bit header from passing as a 32-bit one, whose table sizes would come from unknown2.
+	bool check()
+	{
+		const qint64 minUnpackedFileTableSize = (qint64)fileCount * (qint64)(intSize + sizeof(DatFileTableItem<intSize>));
+		return memcmp(signature, "UOSEDALB", 8) == 0 && version == 2
+			&& fileCount > 0 && packedFileTableSize > 0 && packedFileTableSize <= unpackedFileTableSize
+			&& unpackedFileTableSize >= minUnpackedFileTableSize;
+	}
+};
+
+struct BinXmlHeader
+{
+	quint8 signature[8];
+	qint32 version;
+	qint32 fileSize;
+	quint8 padding[64];
+	quint8 unknown1;
+
+	void init()
+	{
+		memset(this, 0, sizeof(BinXmlHeader));
+		memcpy(signature, "LMXBOSLB", 8);
+		version = 3;
+		unknown1 = 1;
+	}
+};
+#pragma pack(pop)
+
+
+inline qint64 getPaddedSize(qint64 size, qint64 base)
+{
+	return ((size - 1) / base + 1) * base;
+}
+
+template <class T>
+T streamRead(QIODevice * inStream)
+{
+	T var = T();
+	inStream->read((char*)&var, sizeof(T));
+	return var;
+}
+
+template <class T>
+bool streamWrite(QIODevice * outStream, const T & value)
+{
+	return sizeof(value) == outStream->write((const char*)&value, sizeof(value));
+}
+
+// length comes from the stream itself, so it is bounded by what is left in the stream before anything is allocated.
+// size() - pos() is bytesAvailable() for sequential devices.
+inline QString streamReadString(QIODevice * inStream, qint64 length)
+{
+	const qint64 maxLength = qMin<qint64>(inStream->size() - inStream->pos(), 0x7FFFFFFF) / 2;
+	QString result((int)qBound<qint64>(0, length, maxLength), Qt::Uninitialized);
+	const qint64 bytesRead = inStream->read((char*)result.data(), result.length() * 2);
+	result.resize(qMax<qint64>(bytesRead, 0) / 2);
+	return result;
+}
+
+template <int intSize>
+QString streamAutoReadString(QIODevice * inStream, bool useXor, int * outLength = nullptr)
+{
+	const qint64 length = streamRead<typename QIntegerForSize<intSize>::Signed>(inStream);
+	QString result = streamReadString(inStream, length);
+	if(useXor)
+		xorBytes((const quint8*)result.constData(), (quint8*)result.data(), result.length() * 2);
+	if (outLength)
+		*outLength = result.length();
+	return result;
+}
+
+inline bool streamWriteString(QIODevice * outStream, const QString & str)
+{
+	const int bytesToWrite = str.length() * 2;
+	return bytesToWrite == outStream->write((const char*)str.data(), bytesToWrite);
+}
+
+template <int intSize>
+bool streamAutoWriteString(QIODevice * outStream, const QString & str, bool useXor)
+{
+	const int length = str.length();
+	if (!streamWrite<typename QIntegerForSize<intSize>::Signed>(outStream, length))
+		return false;
+	const int bytesToWrite = length * 2;
+	int bytesWritten = 0;
+	if (useXor)
+	{
+		QByteArray temp;
+		appendXorString(temp, str);
+		bytesWritten = outStream->write(temp);
+	}
+	else
+	{
+		bytesWritten = outStream->write((const char*)str.data(), bytesToWrite);
+	}
+	return bytesWritten == bytesToWrite;
+}
+
+template <int intSize>
+struct DatFileEntry
+{
+	QString relativeFilePath;
+	DatFileTableItem<intSize> fileItem;
+};
+
+// Table paths use backslashes and are matched case insensitively, the way the game looks them up.
+inline QString normalizeEntryPath(const QString & path)
+{
+	return QString(path).replace('\\', '/').toLower();
+}
+
+template <int intSize>
+QVector<DatFileEntry<intSize>> readFileTable(QByteArray fileTable, qint64 fileCount)
+{
+	QVector<DatFileEntry<intSize>> entries;
+	// every entry takes at least its length field and the table item, more than that cannot be in the table
+	const qint64 maxFileCount = fileTable.size() / (intSize + sizeof(DatFileTableItem<intSize>));
+	if (fileCount < 0 || fileCount > maxFileCount)
+	{
+		printLine(QString("Error! %1 files do not fit in a file table of %2 bytes").arg(fileCount).arg(fileTable.size()));
+		return entries;
+	}
+	entries.reserve((int)fileCount);
+
+	QBuffer fileTableStream(&fileTable);
+	fileTableStream.open(QIODevice::ReadOnly);
+	for (qint64 i = 0; i < fileCount; ++i)
+	{
+		if (fileTableStream.atEnd())
+			break;
+
+		DatFileEntry<intSize> entry;
+		entry.relativeFilePath = streamAutoReadString<intSize>(&fileTableStream, false);
+		entry.fileItem = DatFileTableItem<intSize>();
+		fileTableStream.read((char*)&entry.fileItem, sizeof(entry.fileItem));
+		entries.append(entry);
+	}
+	return entries;
+}
+
+// Opens inFile if needed, then reads the header and decodes the whole file table.
+template <int intSize>
+bool readDatFile(QFile * inFile, DatFileHeader<intSize> & header, qint64 & dataBeginPos, QVector<DatFileEntry<intSize>> & entries)
+{
+	typedef typename QIntegerForSize<intSize>::Signed qintX;
+	StatsTimer statsTimer(Stats::TableReadStage);
+
+	if (!inFile->isOpen())
+		inFile->open(QIODevice::ReadOnly);
+	if (!inFile->isOpen())
+	{
+		printLine("Error! file open failed");
+		return false;
+	}
+	inFile->seek(0);
+
+	header = DatFileHeader<intSize>();
+	inFile->read((char*)&header, sizeof(header));
+	if (inFile->atEnd())
+		return false;
+
+	if (!header.check())
+	{
+		printLine(QString("Error! corrupted header"));
+		return false;
+	}
+
+	const QByteArray packedFileTable = inFile->read(header.packedFileTableSize);
+	dataBeginPos = streamRead<qintX>(inFile);
+	if (dataBeginPos < inFile->pos())
+		printLine(QString("Warning! error data begin position at %1").arg(inFile->pos() - intSize));
+
+	entries = readFileTable<intSize>(
+		BnsTool::unpack(packedFileTable, header.unpackedFileTableSize, header.isEncrypted, header.isCompressed), header.fileCount);
+	// check() guarantees at least one file, so no entries means the table could not be decoded
+	if (entries.isEmpty())
+	{
+		printLine(QString("Error! corrupted file table"));
+		return false;
+	}
+	return true;
+}
@@ -1,12 +1,35 @@
 TEMPLATE = app
 TARGET = MyBnsTool
-QT += core xml
+QT += core concurrent
 CONFIG += console
 INCLUDEPATH += ./OpenSSL/include
-HEADERS += ./BnsTool.h \
-    ./Util.h
-SOURCES += ./BnsTool.cpp \
+HEADERS += ./AesBackend.h \
+    ./AsyncFileWriter.h \
+    ./BnsArchive.h \
+    ./BnsTool.h \
+    ./DatFormat.h \
+    ./PackCache.h \
+    ./Stats.h \
+    ./TarStream.h \
+    ./Util.h \
+    ./XmlPatch.h \
+    ./XorCodec.h
+SOURCES += ./AesBackend.cpp \
+    ./AsyncFileWriter.cpp \
+    ./BnsArchive.cpp \
+    ./BnsTool.cpp \
     ./main.cpp \
-    ./Util.cpp
+    ./PackCache.cpp \
+    ./Stats.cpp \
+    ./TarStream.cpp \
+    ./Util.cpp \
+    ./XmlPatch.cpp \
+    ./XorCodec.cpp
 RESOURCES += Resource.qrc
-LIBS += ./OpenSSL/lib/libcrypto.lib
\ No newline at end of file
+unix:LIBS += -lz
+LIBS += ./OpenSSL/lib/libcrypto.lib
+# qmake CONFIG+=libdeflate compresses with libdeflate instead of zlib
+libdeflate {
+    DEFINES += USE_LIBDEFLATE
+    LIBS += -ldeflate
+}
@@ -0,0 +1,191 @@
+#include "PackCache.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDirIterator>
+#include <QFile>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <algorithm>
+#include <cstring>
+#ifdef Q_OS_WIN
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+static const char EntrySignature[8] = { 'B', 'N', 'S', 'P', 'A', 'C', 'K', '2' };
+
+#pragma pack(push, 1)
+struct EntryHeader
+{
+	char signature[8];
+	qint32 intermediateSize;
+	qint64 unpackedSize;
+	qint64 packedSize;
+	quint8 isCompressed;
+};
+#pragma pack(pop)
+
+// the modification time doubles as last use time for trim(), QFileDevice::setFileTime() needs Qt 5.10
+static void touchFile(const QString & filePath)
+{
+#ifdef Q_OS_WIN
+	_wutime((const wchar_t*)QDir::toNativeSeparators(filePath).utf16(), nullptr);
+#else
+	utime(QFile::encodeName(filePath).constData(), nullptr);
+#endif
+}
+
+PackCache::PackCache(const QDir & dir, qint64 maxSize)
+	: dir(dir), maxSize(maxSize), hits(0), misses(0), stores(0), storedSizeSinceTrim(0), evictedFileCount(0), evictedByteCount(0)
+{
+	if (!this->dir.exists())
+		this->dir.mkpath(".");
+}
+
+QByteArray PackCache::makeKey(const QByteArray & fileData, const QByteArray & parameterTag)
+{
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	hash.addData(parameterTag);
+	hash.addData("\0", 1);
+	hash.addData(fileData);
+	return hash.result().toHex();
+}
+
+QString PackCache::entryFilePath(const QByteArray & key) const
+{
+	// the first two hex digits fan entries out over 256 subdirectories
+	return dir.filePath(QString::fromLatin1(key.left(2)) + "/" + QString::fromLatin1(key));
+}
+
+bool PackCache::lookup(const QByteArray & key, Entry & entry)
+{
+	QFile file(entryFilePath(key));
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		misses.fetchAndAddRelaxed(1);
+		return false;
+	}
+
+	EntryHeader header;
+	if (file.read((char*)&header, sizeof(header)) != sizeof(header)
+		|| memcmp(header.signature, EntrySignature, sizeof(EntrySignature)) != 0
+		|| header.packedSize != file.size() - (qint64)sizeof(header))
+	{
+		// damaged, e.g. by a full disk, it is simply replaced by the next store()
+		misses.fetchAndAddRelaxed(1);
+		return false;
+	}
+
+	entry.packedFileData = file.read(header.packedSize);
+	entry.intermediateSize = header.intermediateSize;
+	entry.unpackedSize = header.unpackedSize;
+	entry.isCompressed = header.isCompressed != 0;
+	if (entry.packedFileData.size() != header.packedSize)
+	{
+		misses.fetchAndAddRelaxed(1);
+		return false;
+	}
+
+	file.close();
+	touchFile(file.fileName());
+
+	hits.fetchAndAddRelaxed(1);
+	return true;
+}
+
+void PackCache::store(const QByteArray & key, const Entry & entry)
+{
+	const QString filePath = entryFilePath(key);
+	QDir().mkpath(QFileInfo(filePath).path());
+
+	EntryHeader header;
+	memcpy(header.signature, EntrySignature, sizeof(EntrySignature));
+	header.intermediateSize = entry.intermediateSize;
+	header.unpackedSize = entry.unpackedSize;
+	header.packedSize = entry.packedFileData.size();
+	header.isCompressed = entry.isCompressed ? 1 : 0;
+
+	// written under a temporary name and renamed, so readers never see half an entry
+	QSaveFile file(filePath);
+	if (!file.open(QIODevice::WriteOnly))
+		return;
+	file.write((const char*)&header, sizeof(header));
+	file.write(entry.packedFileData);
+	if (!file.commit())
+		return;
+	stores.fetchAndAddRelaxed(1);
+
+	// trimmed while a run stores entries, so the cache never outgrows maxSize by more than a quarter of it
+	const qint64 storedSize = sizeof(header) + entry.packedFileData.size();
+	if (maxSize > 0 && storedSizeSinceTrim.fetchAndAddRelaxed(storedSize) + storedSize >= maxSize / 4 && trimMutex.tryLock())
+	{
+		trimEntries();
+		trimMutex.unlock();
+	}
+}
+
+void PackCache::trim()
+{
+	QMutexLocker locker(&trimMutex);
+	trimEntries();
+}
+
+void PackCache::trimEntries()
+{
+	if (maxSize <= 0)
+		return;
+	storedSizeSinceTrim.store(0);
+
+	QFileInfoList entryFileInfoList;
+	qint64 totalSize = 0;
+	QDirIterator it(dir.path(), QDir::Files, QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		it.next();
+		entryFileInfoList << it.fileInfo();
+		totalSize += it.fileInfo().size();
+	}
+	if (totalSize <= maxSize)
+		return;
+
+	std::sort(entryFileInfoList.begin(), entryFileInfoList.end(), [](const QFileInfo & a, const QFileInfo & b)
+	{
+		return a.lastModified() < b.lastModified();
+	});
+	for (const QFileInfo & fileInfo : entryFileInfoList)
+	{
+		if (totalSize <= maxSize)
+			break;
+		if (!QFile::remove(fileInfo.filePath()))
+			continue;
+		totalSize -= fileInfo.size();
+		evictedFileCount++;
+		evictedByteCount += fileInfo.size();
+	}
+}
+
+qint64 PackCache::hitCount() const
+{
+	return hits.load();
+}
+
+qint64 PackCache::missCount() const
+{
+	return misses.load();
+}
+
+qint64 PackCache::storeCount() const
+{
+	return stores.load();
+}
+
+qint64 PackCache::evictedCount() const
+{
+	return evictedFileCount;
+}
+
+qint64 PackCache::evictedSize() const
+{
+	return evictedByteCount;
+}
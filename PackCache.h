@@ -0,0 +1,54 @@
+#pragma once
+#include <QAtomicInteger>
+#include <QByteArray>
+#include <QDir>
+#include <QMutex>
+#include <QString>
+
+// On-disk cache of packed file data, shared by all compress runs that point at the same directory.
+// Entries are keyed by a hash of the unpacked content and a tag describing everything else that
+// affects the packed result, so changing a pack parameter simply misses instead of serving stale data.
+// lookup() and store() may be called from several threads at once.
+class PackCache
+{
+public:
+	struct Entry
+	{
+		QByteArray packedFileData;
+		qint32 intermediateSize;
+		qint64 unpackedSize;
+		bool isCompressed;
+	};
+
+	PackCache(const QDir & dir, qint64 maxSize);
+
+	static QByteArray makeKey(const QByteArray & fileData, const QByteArray & parameterTag);
+
+	bool lookup(const QByteArray & key, Entry & entry);
+	void store(const QByteArray & key, const Entry & entry);
+
+	// Removes the least recently used entries until the cache fits into maxSize. store() calls it as well
+	// whenever a quarter of maxSize has been stored since the last trim.
+	void trim();
+
+	qint64 hitCount() const;
+	qint64 missCount() const;
+	qint64 storeCount() const;
+	qint64 evictedCount() const;
+	qint64 evictedSize() const;
+
+private:
+	QString entryFilePath(const QByteArray & key) const;
+	void trimEntries();
+
+	QDir dir;
+	const qint64 maxSize;
+	QAtomicInteger<qint64> hits;
+	QAtomicInteger<qint64> misses;
+	QAtomicInteger<qint64> stores;
+	QAtomicInteger<qint64> storedSizeSinceTrim;
+	// trim() runs on one thread at a time, the eviction counters are only changed under it
+	QMutex trimMutex;
+	qint64 evictedFileCount;
+	qint64 evictedByteCount;
+};
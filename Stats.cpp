@@ -0,0 +1,140 @@
+#include "Stats.h"
+#include <QJsonArray>
+#include <QMutex>
+#include <QVector>
+#include <algorithm>
+#include "Util.h"
+
+static const char * const StageNames[Stats::StageCount] = {
+	"table.read",
+	"extract.read",
+	"unpack.decrypt",
+	"unpack.inflate",
+	"xml.bin2text",
+	"extract.mkdir",
+	"extract.write",
+	"compress.read",
+	"compress.baseCompare",
+	"compress.cache",
+	"xml.text2bin",
+	"pack.deflate",
+	"pack.encrypt",
+	"compress.write",
+	"table.write",
+};
+
+struct StageCounters
+{
+	QAtomicInteger<qint64> callCount;
+	QAtomicInteger<qint64> nanoseconds;
+	QAtomicInteger<qint64> bytes;
+};
+
+struct EntryTime
+{
+	QString name;
+	qint64 nanoseconds;
+	qint64 bytes;
+};
+
+bool Stats::enabled = false;
+static StageCounters stageCounters[Stats::StageCount];
+static QMutex slowestEntriesMutex;
+static QVector<EntryTime> slowestEntries;
+static int maxSlowestEntryCount = 10;
+
+void Stats::setEnabled(bool isEnabled, int slowestEntryCount)
+{
+	enabled = isEnabled;
+	maxSlowestEntryCount = qMax(0, slowestEntryCount);
+}
+
+void Stats::add(Stage stage, qint64 nanoseconds, qint64 bytes)
+{
+	StageCounters & counters = stageCounters[stage];
+	counters.callCount.fetchAndAddRelaxed(1);
+	counters.nanoseconds.fetchAndAddRelaxed(nanoseconds);
+	counters.bytes.fetchAndAddRelaxed(bytes);
+}
+
+static bool isSlower(const EntryTime & a, const EntryTime & b)
+{
+	return a.nanoseconds > b.nanoseconds;
+}
+
+void Stats::addEntry(const QString & name, qint64 nanoseconds, qint64 bytes)
+{
+	QMutexLocker locker(&slowestEntriesMutex);
+	if (slowestEntries.size() >= maxSlowestEntryCount)
+	{
+		// kept sorted, slowest first, so the last one is the one to beat
+		if (slowestEntries.isEmpty() || nanoseconds <= slowestEntries.last().nanoseconds)
+			return;
+		slowestEntries.removeLast();
+	}
+	const EntryTime entryTime = { name, nanoseconds, bytes };
+	slowestEntries.insert(std::upper_bound(slowestEntries.begin(), slowestEntries.end(), entryTime, isSlower), entryTime);
+}
+
+static double toMegabytesPerSecond(qint64 bytes, qint64 nanoseconds)
+{
+	return nanoseconds > 0 ? bytes / (nanoseconds / 1e9) / (1024 * 1024) : 0.0;
+}
+
+void Stats::print(qint64 wallNanoseconds)
+{
+	printLine(QString("%1 %2 %3 %4 %5").arg("stage", -22).arg("calls", 10).arg("bytes", 14).arg("seconds", 10).arg("MB/s", 10));
+	for (int i = 0; i < StageCount; ++i)
+	{
+		const StageCounters & counters = stageCounters[i];
+		if (counters.callCount.load() == 0)
+			continue;
+		printLine(QString("%1 %2 %3 %4 %5").arg(StageNames[i], -22).arg(counters.callCount.load(), 10).arg(counters.bytes.load(), 14)
+			.arg(counters.nanoseconds.load() / 1e9, 10, 'f', 3).arg(toMegabytesPerSecond(counters.bytes.load(), counters.nanoseconds.load()), 10, 'f', 1));
+	}
+	printLine(QString("wall time %1 s").arg(wallNanoseconds / 1e9, 0, 'f', 3));
+
+	QMutexLocker locker(&slowestEntriesMutex);
+	if (slowestEntries.isEmpty())
+		return;
+	printLine(QString("slowest %1 entries:").arg(slowestEntries.size()));
+	for (const EntryTime & entryTime : slowestEntries)
+		printLine(QString("%1 s %2  %3").arg(entryTime.nanoseconds / 1e9, 10, 'f', 4).arg(entryTime.bytes, 12).arg(entryTime.name));
+}
+
+QJsonObject Stats::toJson(qint64 wallNanoseconds)
+{
+	QJsonArray stages;
+	for (int i = 0; i < StageCount; ++i)
+	{
+		const StageCounters & counters = stageCounters[i];
+		if (counters.callCount.load() == 0)
+			continue;
+		QJsonObject stage;
+		stage["name"] = StageNames[i];
+		stage["calls"] = (double)counters.callCount.load();
+		stage["bytes"] = (double)counters.bytes.load();
+		stage["seconds"] = counters.nanoseconds.load() / 1e9;
+		stage["mbPerSecond"] = toMegabytesPerSecond(counters.bytes.load(), counters.nanoseconds.load());
+		stages.append(stage);
+	}
+
+	QJsonArray entries;
+	{
+		QMutexLocker locker(&slowestEntriesMutex);
+		for (const EntryTime & entryTime : slowestEntries)
+		{
+			QJsonObject entry;
+			entry["name"] = entryTime.name;
+			entry["seconds"] = entryTime.nanoseconds / 1e9;
+			entry["bytes"] = (double)entryTime.bytes;
+			entries.append(entry);
+		}
+	}
+
+	QJsonObject root;
+	root["wallSeconds"] = wallNanoseconds / 1e9;
+	root["stages"] = stages;
+	root["slowestEntries"] = entries;
+	return root;
+}
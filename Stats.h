@@ -0,0 +1,78 @@
+#pragma once
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QString>
+
+// Optional per stage timing for --stats. Stages are added up over all threads, so with -j their
+// times can exceed the wall time. When disabled every hook costs a single branch.
+class Stats
+{
+public:
+	enum Stage
+	{
+		TableReadStage,
+		ExtractReadStage,
+		DecryptStage,
+		InflateStage,
+		XmlBin2TextStage,
+		ExtractMkdirStage,
+		ExtractWriteStage,
+		CompressReadStage,
+		BaseCompareStage,
+		CacheStage,
+		XmlText2BinStage,
+		DeflateStage,
+		EncryptStage,
+		CompressWriteStage,
+		TableWriteStage,
+		StageCount
+	};
+
+	static bool isEnabled()
+	{
+		return enabled;
+	}
+
+	// must be called before any work starts
+	static void setEnabled(bool isEnabled, int slowestEntryCount = 10);
+
+	static void add(Stage stage, qint64 nanoseconds, qint64 bytes);
+	// keeps the slowest entries, nanoseconds is the time one entry spent in the worker
+	static void addEntry(const QString & name, qint64 nanoseconds, qint64 bytes);
+
+	static void print(qint64 wallNanoseconds);
+	static QJsonObject toJson(qint64 wallNanoseconds);
+
+private:
+	static bool enabled;
+};
+
+// Adds the time between construction and destruction to a stage.
+class StatsTimer
+{
+public:
+	explicit StatsTimer(Stats::Stage stage, qint64 bytes = 0)
+		: stage(stage), bytes(bytes), isRunning(Stats::isEnabled())
+	{
+		if (isRunning)
+			timer.start();
+	}
+
+	~StatsTimer()
+	{
+		if (isRunning)
+			Stats::add(stage, timer.nsecsElapsed(), bytes);
+	}
+
+	void setBytes(qint64 bytes)
+	{
+		this->bytes = bytes;
+	}
+
+private:
+	const Stats::Stage stage;
+	qint64 bytes;
+	const bool isRunning;
+	QElapsedTimer timer;
+};
@@ -0,0 +1,295 @@
+#include "TarStream.h"
+#include <QDateTime>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include "Util.h"
+
+static const int TarBlockSize = 512;
+
+#pragma pack(push, 1)
+struct TarHeader
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char typeFlag;
+	char linkName[100];
+	char magic[6];
+	char version[2];
+	char userName[32];
+	char groupName[32];
+	char deviceMajor[8];
+	char deviceMinor[8];
+	char prefix[155];
+	char padding[12];
+};
+#pragma pack(pop)
+
+static void writeOctal(char * field, int fieldSize, qint64 value)
+{
+	// fieldSize - 1 digits and a terminating zero
+	const QByteArray digits = QByteArray::number(value, 8).rightJustified(fieldSize - 1, '0');
+	memcpy(field, digits.constData(), fieldSize - 1);
+	field[fieldSize - 1] = '\0';
+}
+
+// Octal, or base-256 with the high bit of the first byte set as GNU tar writes sizes of 8 GB and more.
+static qint64 readNumber(const char * field, int fieldSize)
+{
+	qint64 value = 0;
+	if ((quint8)field[0] & 0x80)
+	{
+		value = (quint8)field[0] & 0x7F;
+		for (int i = 1; i < fieldSize; ++i)
+			value = (value << 8) | (quint8)field[i];
+		return value;
+	}
+	for (int i = 0; i < fieldSize; ++i)
+	{
+		if (field[i] >= '0' && field[i] <= '7')
+			value = value * 8 + (field[i] - '0');
+		else if (field[i] != ' ' || value != 0)
+			break;
+	}
+	return value;
+}
+
+static qint64 headerChecksum(const TarHeader & header)
+{
+	// the checksum field itself counts as eight spaces
+	const quint8 * bytes = (const quint8*)&header;
+	qint64 sum = 8 * ' ';
+	for (int i = 0; i < TarBlockSize; ++i)
+	{
+		if (i < (int)offsetof(TarHeader, checksum) || i >= (int)offsetof(TarHeader, checksum) + (int)sizeof(header.checksum))
+			sum += bytes[i];
+	}
+	return sum;
+}
+
+static QByteArray readField(const char * field, int fieldSize)
+{
+	return QByteArray(field, (int)qstrnlen(field, fieldSize));
+}
+
+
+TarWriter::TarWriter(QIODevice * outStream)
+	: outStream(outStream), modificationTime(QDateTime::currentMSecsSinceEpoch() / 1000), isFailed(false)
+{
+}
+
+bool TarWriter::writeFile(const QString & relativeFilePath, const QByteArray & data)
+{
+	const QByteArray name = relativeFilePath.toUtf8();
+	if (name.size() > (int)sizeof(TarHeader::name))
+	{
+		// the name goes in front as the data of a GNU long name entry
+		writeHeader("././@LongLink", name.size() + 1, 'L');
+		writeData(name + '\0');
+	}
+	writeHeader(name, data.size(), '0');
+	writeData(data);
+	return !isFailed;
+}
+
+bool TarWriter::finish()
+{
+	if (outStream->write(QByteArray(2 * TarBlockSize, '\0')) != 2 * TarBlockSize)
+		isFailed = true;
+	return !isFailed;
+}
+
+void TarWriter::writeHeader(const QByteArray & name, qint64 size, char typeFlag)
+{
+	TarHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.name, name.constData(), qMin<int>(name.size(), sizeof(header.name)));
+	writeOctal(header.mode, sizeof(header.mode), 0644);
+	writeOctal(header.uid, sizeof(header.uid), 0);
+	writeOctal(header.gid, sizeof(header.gid), 0);
+	writeOctal(header.size, sizeof(header.size), size);
+	writeOctal(header.mtime, sizeof(header.mtime), modificationTime);
+	header.typeFlag = typeFlag;
+	memcpy(header.magic, "ustar", 6);
+	memcpy(header.version, "00", 2);
+	writeOctal(header.checksum, sizeof(header.checksum) - 1, headerChecksum(header));
+	header.checksum[7] = ' ';
+	if (outStream->write((const char*)&header, sizeof(header)) != sizeof(header))
+		isFailed = true;
+}
+
+void TarWriter::writeData(const QByteArray & data)
+{
+	if (outStream->write(data) != data.size())
+		isFailed = true;
+	const int paddingSize = (TarBlockSize - data.size() % TarBlockSize) % TarBlockSize;
+	if (paddingSize > 0 && outStream->write(QByteArray(paddingSize, '\0')) != paddingSize)
+		isFailed = true;
+}
+
+
+TarReader::TarReader(QIODevice * inStream)
+	: inStream(inStream), isFailed(false)
+{
+}
+
+bool TarReader::failed() const
+{
+	return isFailed;
+}
+
+bool TarReader::readNext(QString & relativeFilePath, QByteArray & data)
+{
+	QByteArray longName;
+	while (true)
+	{
+		TarHeader header;
+		if (!readBlock((char*)&header))
+		{
+			// a stream cut off between two entries still has to end with the zero blocks
+			if (!isFailed)
+			{
+				printLine("Error! tar stream ended without an end of archive marker");
+				isFailed = true;
+			}
+			return false;
+		}
+
+		// a zero block ends the archive
+		const char * bytes = (const char*)&header;
+		if (std::all_of(bytes, bytes + TarBlockSize, [](char c) { return c == '\0'; }))
+			return false;
+
+		if (readNumber(header.checksum, sizeof(header.checksum)) != headerChecksum(header))
+		{
+			printLine("Error! tar header checksum mismatch");
+			isFailed = true;
+			return false;
+		}
+
+		const qint64 size = readNumber(header.size, sizeof(header.size));
+		if (size < 0)
+		{
+			isFailed = true;
+			return false;
+		}
+
+		if (header.typeFlag == 'L' || header.typeFlag == 'x')
+		{
+			QByteArray extendedData;
+			if (!readData(size, extendedData))
+				return false;
+			if (header.typeFlag == 'L')
+			{
+				longName = readField(extendedData.constData(), extendedData.size());
+				continue;
+			}
+			// pax records are "<length> <key>=<value>\n", only the path is used
+			int pos = 0;
+			while (pos < extendedData.size())
+			{
+				const int spaceIndex = extendedData.indexOf(' ', pos);
+				const int recordLength = extendedData.mid(pos, spaceIndex - pos).toInt();
+				if (spaceIndex < 0 || recordLength <= 0 || pos + recordLength > extendedData.size())
+					break;
+				const QByteArray record = extendedData.mid(spaceIndex + 1, pos + recordLength - spaceIndex - 2);
+				if (record.startsWith("path="))
+					longName = record.mid(5);
+				pos += recordLength;
+			}
+			continue;
+		}
+
+		if (header.typeFlag != '0' && header.typeFlag != '\0' && header.typeFlag != '7')
+		{
+			if (!skipData(size))
+				return false;
+			longName.clear();
+			continue;
+		}
+
+		QByteArray name = longName;
+		if (name.isEmpty())
+		{
+			name = readField(header.name, sizeof(header.name));
+			const QByteArray prefix = readField(header.prefix, sizeof(header.prefix));
+			if (memcmp(header.magic, "ustar", 5) == 0 && !prefix.isEmpty())
+				name = prefix + '/' + name;
+		}
+		while (name.startsWith("./"))
+			name = name.mid(2);
+
+		if (!readData(size, data))
+			return false;
+		relativeFilePath = QString::fromUtf8(name);
+		return true;
+	}
+}
+
+bool TarReader::readBlock(char * block)
+{
+	qint64 readSize = 0;
+	while (readSize < TarBlockSize)
+	{
+		const qint64 size = inStream->read(block + readSize, TarBlockSize - readSize);
+		if (size <= 0)
+			break;
+		readSize += size;
+	}
+	if (readSize == 0)
+		return false;
+	if (readSize < TarBlockSize)
+	{
+		printLine("Error! unexpected end of tar stream");
+		isFailed = true;
+		return false;
+	}
+	return true;
+}
+
+bool TarReader::readData(qint64 size, QByteArray & data)
+{
+	if (size > 0x7FFFFFFF - TarBlockSize)
+	{
+		printLine(QString("Error! tar entry of %1 bytes is too large").arg(size));
+		isFailed = true;
+		return false;
+	}
+	const int paddedSize = (int)((size + TarBlockSize - 1) / TarBlockSize * TarBlockSize);
+	data = QByteArray(paddedSize, Qt::Uninitialized);
+	qint64 readSize = 0;
+	while (readSize < paddedSize)
+	{
+		const qint64 chunkSize = inStream->read(data.data() + readSize, paddedSize - readSize);
+		if (chunkSize <= 0)
+			break;
+		readSize += chunkSize;
+	}
+	if (readSize < paddedSize)
+	{
+		printLine("Error! unexpected end of tar stream");
+		isFailed = true;
+		return false;
+	}
+	data.resize((int)size);
+	return true;
+}
+
+bool TarReader::skipData(qint64 size)
+{
+	char block[TarBlockSize];
+	for (qint64 remaining = (size + TarBlockSize - 1) / TarBlockSize; remaining > 0; --remaining)
+	{
+		if (!readBlock(block))
+		{
+			isFailed = true;
+			return false;
+		}
+	}
+	return true;
+}
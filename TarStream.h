@@ -0,0 +1,46 @@
+#pragma once
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+
+// Minimal ustar support for piping extract and compress through other tools without touching the disk.
+// Only regular files are written, paths are '/' separated UTF-8. Names longer than ustar allows are
+// written as GNU long name entries, which tar, bsdtar and Python's tarfile all read.
+class TarWriter
+{
+public:
+	explicit TarWriter(QIODevice * outStream);
+
+	bool writeFile(const QString & relativeFilePath, const QByteArray & data);
+	// writes the two zero blocks that end an archive
+	bool finish();
+
+private:
+	void writeHeader(const QByteArray & name, qint64 size, char typeFlag);
+	void writeData(const QByteArray & data);
+
+	QIODevice * outStream;
+	const qint64 modificationTime;
+	bool isFailed;
+};
+
+// Reads regular files from a ustar, GNU or pax stream in the order they appear. Directories and
+// other entry types are skipped. The stream is read strictly forward, so it can be a pipe.
+class TarReader
+{
+public:
+	explicit TarReader(QIODevice * inStream);
+
+	// Returns false at the end of the archive or on an error, failed() tells which. Running out of input
+	// before the zero block that ends an archive is an error.
+	bool readNext(QString & relativeFilePath, QByteArray & data);
+	bool failed() const;
+
+private:
+	bool readBlock(char * block);
+	bool readData(qint64 size, QByteArray & data);
+	bool skipData(qint64 size);
+
+	QIODevice * inStream;
+	bool isFailed;
+};
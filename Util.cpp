@@ -1,22 +1,194 @@
 #include "Util.h"
+#include <QAtomicInt>
+#include <QDirIterator>
+#include <QHash>
+#include <QMutex>
+#include <QThread>
+#include <algorithm>
 #include <iostream>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
 
-QFileInfoList recursiveFindFile(QDir dir)
+struct ScannedEntry
 {
-	QFileInfoList result;
-	for (const QFileInfo & fileInfo : dir.entryInfoList())
+	QString name;
+	bool isDir;
+	qint64 size;
+};
+
+// same order as QDir::Name | QDir::IgnoreCase, names differing only in case fall back to a case sensitive compare
+static bool isScannedEntryLess(const ScannedEntry & a, const ScannedEntry & b)
+{
+	const int result = a.name.compare(b.name, Qt::CaseInsensitive);
+	if (result != 0)
+		return result < 0;
+	return a.name < b.name;
+}
+
+static QVector<ScannedEntry> scanDirectory(const QString & dirPath)
+{
+	QVector<ScannedEntry> entries;
+#ifdef Q_OS_WIN
+	// FindFirstFile/FindNextFile return the size with the name, so QDirIterator needs no extra call per file
+	QDirIterator it(dirPath, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+	while (it.hasNext())
+	{
+		it.next();
+		const QFileInfo fileInfo = it.fileInfo();
+		const ScannedEntry entry = { fileInfo.fileName(), fileInfo.isDir(), fileInfo.isDir() ? 0 : fileInfo.size() };
+		entries.append(entry);
+	}
+#else
+	DIR * dir = opendir(QFile::encodeName(dirPath).constData());
+	if (!dir)
+		return entries;
+	const int dirFd = dirfd(dir);
+	while (const dirent * dirEntry = readdir(dir))
 	{
-		if (fileInfo.fileName() == "." || fileInfo.fileName() == "..")
+		// QDir skips hidden entries by default, which also takes care of . and ..
+		if (dirEntry->d_name[0] == '.')
+			continue;
+		// stat rather than lstat, symbolic links count as what they point to like in QFileInfo
+		struct stat fileStat;
+		if (fstatat(dirFd, dirEntry->d_name, &fileStat, 0) != 0)
+			continue;
+		const bool isDir = S_ISDIR(fileStat.st_mode);
+		if (!isDir && !S_ISREG(fileStat.st_mode))
 			continue;
-		if (fileInfo.isFile())
-			result << fileInfo;
-		else if (fileInfo.isDir())
-			result << recursiveFindFile(QDir(fileInfo.filePath()));
+		const ScannedEntry entry = { QFile::decodeName(dirEntry->d_name), isDir, isDir ? 0 : (qint64)fileStat.st_size };
+		entries.append(entry);
 	}
-	return result;
+	closedir(dir);
+#endif
+	std::sort(entries.begin(), entries.end(), isScannedEntryLess);
+	return entries;
 }
 
+static void appendScannedFiles(const QHash<QString, QVector<ScannedEntry>> & dirEntries, const QString & relativeDirPath, QVector<ScannedFile> & files)
+{
+	for (const ScannedEntry & entry : dirEntries.value(relativeDirPath))
+	{
+		const QString relativePath = relativeDirPath.isEmpty() ? entry.name : (relativeDirPath + "/" + entry.name);
+		if (entry.isDir)
+		{
+			appendScannedFiles(dirEntries, relativePath, files);
+		}
+		else
+		{
+			const ScannedFile file = { relativePath, entry.size };
+			files.append(file);
+		}
+	}
+}
+
+QVector<ScannedFile> scanFiles(const QDir & dir, int threadCount)
+{
+	QThreadPool::globalInstance()->setMaxThreadCount(resolveThreadCount(threadCount));
+
+	// read one level of directories at a time in parallel, then put the files in order from the collected listings
+	QHash<QString, QVector<ScannedEntry>> dirEntries;
+	QStringList pendingRelativeDirPaths(QString(""));
+	while (!pendingRelativeDirPaths.isEmpty())
+	{
+		const QString dirPath = dir.path();
+		const QList<QVector<ScannedEntry>> listings = QtConcurrent::blockingMapped<QList<QVector<ScannedEntry>>>(pendingRelativeDirPaths,
+			[dirPath](const QString & relativeDirPath)
+		{
+			return scanDirectory(relativeDirPath.isEmpty() ? dirPath : (dirPath + "/" + relativeDirPath));
+		});
+
+		QStringList nextRelativeDirPaths;
+		for (int i = 0; i < pendingRelativeDirPaths.size(); ++i)
+		{
+			const QString & relativeDirPath = pendingRelativeDirPaths.at(i);
+			for (const ScannedEntry & entry : listings.at(i))
+			{
+				if (entry.isDir)
+					nextRelativeDirPaths.append(relativeDirPath.isEmpty() ? entry.name : (relativeDirPath + "/" + entry.name));
+			}
+			dirEntries.insert(relativeDirPath, listings.at(i));
+		}
+		pendingRelativeDirPaths.swap(nextRelativeDirPaths);
+	}
+
+	QVector<ScannedFile> files;
+	appendScannedFiles(dirEntries, QString(""), files);
+	return files;
+}
+
+static QAtomicInt isPrintLineEnabled(1);
+static QAtomicInt isPrintLineToStderr(0);
+
 void printLine(const QString & str)
 {
-	std::cout << str.toLocal8Bit().data() << "\n";
+	if (!isPrintLineEnabled.load())
+		return;
+	const QByteArray line = str.toLocal8Bit() + '\n';
+	// printLine is called from worker threads too, whole lines keep their output from interleaving
+	static QMutex mutex;
+	QMutexLocker locker(&mutex);
+	std::ostream & outStream = isPrintLineToStderr.load() ? std::cerr : std::cout;
+	outStream.write(line.constData(), line.size());
+}
+
+void setPrintLineEnabled(bool isEnabled)
+{
+	isPrintLineEnabled.store(isEnabled ? 1 : 0);
+}
+
+void setPrintLineToStderr(bool isToStderr)
+{
+	isPrintLineToStderr.store(isToStderr ? 1 : 0);
+}
+
+bool replaceFile(const QString & fromFileName, const QString & toFileName)
+{
+#ifdef Q_OS_WIN
+	const QString nativeFromFileName = QDir::toNativeSeparators(fromFileName);
+	const QString nativeToFileName = QDir::toNativeSeparators(toFileName);
+	return MoveFileExW((LPCWSTR)nativeFromFileName.utf16(), (LPCWSTR)nativeToFileName.utf16(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return ::rename(QFile::encodeName(fromFileName).constData(), QFile::encodeName(toFileName).constData()) == 0;
+#endif
+}
+
+int resolveThreadCount(int requestedCount)
+{
+	if (requestedCount > 0)
+		return requestedCount;
+	return qMax(1, QThread::idealThreadCount());
+}
+
+QString takeOption(QStringList & argumentList, const QString & name, const QString & defaultValue)
+{
+	const int index = argumentList.indexOf(name);
+	if (index < 0 || index + 1 >= argumentList.size())
+		return defaultValue;
+	const QString value = argumentList.at(index + 1);
+	argumentList.removeAt(index + 1);
+	argumentList.removeAt(index);
+	return value;
+}
+
+QStringList takeOptions(QStringList & argumentList, const QString & name)
+{
+	QStringList valueList;
+	for (;;)
+	{
+		const QString value = takeOption(argumentList, name);
+		if (value.isNull())
+			return valueList;
+		valueList.append(value);
+	}
+}
+
+bool takeFlag(QStringList & argumentList, const QString & name)
+{
+	return argumentList.removeAll(name) > 0;
 }
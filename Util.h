@@ -1,7 +1,82 @@
 #pragma once
 #include <QFileInfo>
 #include <QList>
+#include <QStringList>
 #include <QDir>
+#include <QVector>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrentMap>
 
-QFileInfoList recursiveFindFile(QDir dir);
-void printLine(const QString & str);
\ No newline at end of file
+struct ScannedFile
+{
+	// relative to the scanned directory, separated by '/'
+	QString relativeFilePath;
+	qint64 size;
+};
+
+// Lists all files below dir in the order a recursive QDir::entryInfoList() walk gives: depth first,
+// entries of a directory sorted by name ignoring case, hidden entries skipped. Directories are read
+// in parallel and every file is looked at once, its size comes along for free.
+QVector<ScannedFile> scanFiles(const QDir & dir, int threadCount);
+void printLine(const QString & str);
+// lets benchmarks keep the per file progress lines out of their measurements
+void setPrintLineEnabled(bool isEnabled);
+// keeps stdout free for data when it is piped, e.g. a tar stream
+void setPrintLineToStderr(bool isToStderr);
+// Renames fromFileName to toFileName in one step, an existing toFileName is replaced and never missing in between.
+bool replaceFile(const QString & fromFileName, const QString & toFileName);
+int resolveThreadCount(int requestedCount);
+
+// Command line helpers, options are removed from argumentList once taken.
+QString takeOption(QStringList & argumentList, const QString & name, const QString & defaultValue = QString());
+QStringList takeOptions(QStringList & argumentList, const QString & name);
+bool takeFlag(QStringList & argumentList, const QString & name);
+
+// prepare() and finish() run on the calling thread in task order, process() runs on the global
+// thread pool. While one batch is being processed, the previous one is finished and the next one
+// is prepared, so reading and writing overlap with the work of the pool.
+template <class Task, class Prepare, class Process, class Finish>
+void runOrderedPipeline(int threadCount, int batchSize, Prepare prepare, Process process, Finish finish)
+{
+	if (threadCount <= 1)
+	{
+		Task task;
+		while (prepare(task))
+		{
+			process(task);
+			finish(task);
+			task = Task();
+		}
+		return;
+	}
+
+	QThreadPool::globalInstance()->setMaxThreadCount(threadCount);
+
+	QVector<Task> runningBatch;
+	QFuture<void> future;
+	bool exhausted = false;
+	while (!exhausted || !runningBatch.isEmpty())
+	{
+		QVector<Task> nextBatch;
+		while (!exhausted && nextBatch.size() < batchSize)
+		{
+			Task task;
+			if (prepare(task))
+				nextBatch.append(task);
+			else
+				exhausted = true;
+		}
+
+		future.waitForFinished();
+		QVector<Task> finishedBatch;
+		finishedBatch.swap(runningBatch);
+		runningBatch.swap(nextBatch);
+		if (!runningBatch.isEmpty())
+			future = QtConcurrent::map(runningBatch, process);
+
+		for (Task & task : finishedBatch)
+			finish(task);
+	}
+	future.waitForFinished();
+}
@@ -0,0 +1,405 @@
+#include "XmlPatch.h"
+#include <QFile>
+#include <QPair>
+#include <QRegExp>
+#include <cstring>
+#include "DatFormat.h"
+#include "Util.h"
+#include "XorCodec.h"
+
+// a string record as binary xml stores it: qint32 length followed by the XORed UTF-16 code units
+static QByteArray encodeRecord(const QString & str)
+{
+	QByteArray record;
+	const qint32 length = str.length();
+	record.append((const char*)&length, sizeof(length));
+	appendXorString(record, str);
+	return record;
+}
+
+bool XmlPatch::load(const QString & fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+	{
+		printLine(QString("Error! file %1 open failed").arg(fileName));
+		return false;
+	}
+
+	sections.clear();
+	int lineNumber = 0;
+	while (!file.atEnd())
+	{
+		QString line = QString::fromUtf8(file.readLine()).trimmed();
+		++lineNumber;
+		if (lineNumber == 1 && line.startsWith(QChar(0xFEFF)))
+			line = line.mid(1).trimmed();
+		if (line.isEmpty() || line.startsWith('#'))
+			continue;
+
+		if (line.startsWith('['))
+		{
+			if (!line.endsWith(']') || line.length() <= 2)
+			{
+				printLine(QString("Error! invalid section at %1:%2").arg(fileName).arg(lineNumber));
+				return false;
+			}
+			Section section;
+			section.pattern = normalizeEntryPath(line.mid(1, line.length() - 2).trimmed());
+			sections.append(section);
+			continue;
+		}
+
+		Rule rule;
+		if (!parseRule(line, rule))
+		{
+			printLine(QString("Error! invalid rule at %1:%2, expected <path>@<attribute>=<value>").arg(fileName).arg(lineNumber));
+			return false;
+		}
+		if (sections.isEmpty())
+			sections.append(Section());
+		sections.last().rules.append(rule);
+	}
+	return true;
+}
+
+bool XmlPatch::parseRule(const QString & line, Rule & rule)
+{
+	const int length = line.length();
+	int i = 0;
+	while (true)
+	{
+		Step step;
+		const int nameBegin = i;
+		while (i < length && line.at(i) != '/' && line.at(i) != '[' && line.at(i) != '@')
+			++i;
+		const QString tagName = line.mid(nameBegin, i - nameBegin).trimmed();
+		if (tagName.isEmpty())
+			return false;
+		step.isAnyTag = (tagName == "*");
+		step.tagName = encodeRecord(tagName);
+
+		while (i < length && line.at(i) == '[')
+		{
+			const int closeIndex = line.indexOf(']', i);
+			if (closeIndex < 0)
+				return false;
+			const QString condition = line.mid(i + 1, closeIndex - i - 1);
+			const int separatorIndex = condition.indexOf('=');
+			if (separatorIndex <= 0)
+				return false;
+			Condition stepCondition = { encodeRecord(condition.left(separatorIndex).trimmed()), encodeRecord(condition.mid(separatorIndex + 1)) };
+			step.conditions.append(stepCondition);
+			i = closeIndex + 1;
+		}
+		rule.steps.append(step);
+
+		if (i < length && line.at(i) == '/')
+			++i;
+		else
+			break;
+	}
+
+	if (i >= length || line.at(i) != '@')
+		return false;
+	const int separatorIndex = line.indexOf('=', i);
+	const QString key = line.mid(i + 1, separatorIndex - i - 1).trimmed();
+	if (separatorIndex < 0 || key.isEmpty())
+		return false;
+	rule.key = encodeRecord(key);
+	rule.value = encodeRecord(line.mid(separatorIndex + 1));
+	return true;
+}
+
+bool XmlPatch::isEmpty() const
+{
+	return ruleCount() == 0;
+}
+
+int XmlPatch::ruleCount() const
+{
+	int count = 0;
+	for (const Section & section : sections)
+		count += section.rules.size();
+	return count;
+}
+
+XmlPatch XmlPatch::select(const QString & relativeFilePath) const
+{
+	const QString normalizedPath = normalizeEntryPath(relativeFilePath);
+	XmlPatch result;
+	Section selected;
+	for (const Section & section : sections)
+	{
+		if (!section.pattern.isEmpty())
+		{
+			const QRegExp regExp(section.pattern, Qt::CaseSensitive, QRegExp::Wildcard);
+			const QRegExp suffixRegExp("*/" + section.pattern, Qt::CaseSensitive, QRegExp::Wildcard);
+			if (!regExp.exactMatch(normalizedPath) && !suffixRegExp.exactMatch(normalizedPath))
+				continue;
+		}
+		selected.rules += section.rules;
+	}
+	if (!selected.rules.isEmpty())
+		result.sections.append(selected);
+	return result;
+}
+
+
+// Walks the node stream like convertBinXmlNode() does, but only keeps the spans of the records it passes.
+// Bytes are copied to the output lazily, up to the attribute list of the next element that changes,
+// so a stream without changes is never copied at all.
+class XmlPatch::Patcher
+{
+public:
+	Patcher(const XmlPatch & xmlPatch, const QByteArray & bytes)
+		: begin(bytes.constData()), pos(bytes.constData()), end(bytes.constData() + bytes.size()), copiedPos(bytes.constData()),
+		isFailed(false), changeCount(0)
+	{
+		for (const Section & section : xmlPatch.sections)
+		{
+			for (const Rule & rule : section.rules)
+			{
+				rootRuleIndexes.append(rules.size());
+				rules.append(&rule);
+			}
+		}
+	}
+
+	bool run(QByteArray & outBytes, int & outChangeCount)
+	{
+		if (end - begin <= (qint64)sizeof(BinXmlHeader) || memcmp(begin, "LMXBOSLB", 8) != 0)
+			return false;
+		pos = begin + sizeof(BinXmlHeader);
+		readRecord();		// originalFilePath
+		if (isFailed || !patchNode(true))
+			return false;
+
+		outChangeCount = changeCount;
+		if (changeCount == 0)
+			return true;
+
+		output.append(copiedPos, end - copiedPos);
+		BinXmlHeader header;
+		memcpy(&header, output.constData(), sizeof(header));
+		header.fileSize = output.size();
+		memcpy(output.data(), &header, sizeof(header));
+		outBytes = output;
+		return true;
+	}
+
+private:
+	struct Record
+	{
+		const char * data;
+		int size;
+
+		bool operator==(const QByteArray & encoded) const
+		{
+			return size == encoded.size() && memcmp(data, encoded.constData(), size) == 0;
+		}
+	};
+
+	struct Element
+	{
+		Record tagName;
+		QVector<QPair<Record, Record>> attributes;
+		// rules whose steps match the path down to this element
+		QVector<int> ruleIndexes;
+	};
+
+	template <class T>
+	T read()
+	{
+		T value = T();
+		if (end - pos < (qint64)sizeof(T))
+		{
+			isFailed = true;
+			pos = end;
+			return value;
+		}
+		memcpy(&value, pos, sizeof(T));
+		pos += sizeof(T);
+		return value;
+	}
+
+	Record readRecord()
+	{
+		Record record = { pos, 0 };
+		const qint32 length = read<qint32>();
+		if (length < 0 || (end - pos) / 2 < length)
+		{
+			isFailed = true;
+			pos = end;
+			return record;
+		}
+		pos += length * 2;
+		record.size = pos - record.data;
+		return record;
+	}
+
+	bool stepMatches(const Step & step, const Element & element) const
+	{
+		if (!step.isAnyTag && !(element.tagName == step.tagName))
+			return false;
+		for (const Condition & condition : step.conditions)
+		{
+			bool isMatched = false;
+			for (const QPair<Record, Record> & attribute : element.attributes)
+			{
+				if (attribute.first == condition.key && attribute.second == condition.value)
+				{
+					isMatched = true;
+					break;
+				}
+			}
+			if (!isMatched)
+				return false;
+		}
+		return true;
+	}
+
+	// Applies the rules that end at element, rewriting its attribute list if any value changes.
+	void patchAttributes(Element & element, const char * attributeCountPos, const char * attributesEndPos)
+	{
+		const int depth = openElements.size();
+		const QVector<int> & candidateIndexes = (depth == 0) ? rootRuleIndexes : openElements.last().ruleIndexes;
+
+		QVector<const QByteArray *> newValues;
+		QVector<const Rule *> addedRules;
+		int elementChangeCount = 0;
+		for (const int index : candidateIndexes)
+		{
+			const Rule & rule = *rules.at(index);
+			if (rule.steps.size() <= depth || !stepMatches(rule.steps.at(depth), element))
+				continue;
+			element.ruleIndexes.append(index);
+			if (rule.steps.size() != depth + 1)
+				continue;
+
+			if (newValues.isEmpty())
+				newValues.fill(nullptr, element.attributes.size());
+			bool isFound = false;
+			for (int i = 0; i < element.attributes.size(); ++i)
+			{
+				if (!(element.attributes.at(i).first == rule.key))
+					continue;
+				isFound = true;
+				if (!(element.attributes.at(i).second == rule.value) || newValues.at(i))
+				{
+					newValues[i] = &rule.value;
+					elementChangeCount++;
+				}
+			}
+			for (int i = 0; i < addedRules.size() && !isFound; ++i)
+			{
+				if (addedRules.at(i)->key == rule.key)
+				{
+					addedRules[i] = &rule;
+					isFound = true;
+				}
+			}
+			if (!isFound)
+			{
+				addedRules.append(&rule);
+				elementChangeCount++;
+			}
+		}
+		if (elementChangeCount == 0)
+			return;
+
+		if (output.isEmpty())
+			output.reserve((end - begin) + (end - begin) / 16);
+		output.append(copiedPos, attributeCountPos - copiedPos);
+		const qint32 attributeCount = element.attributes.size() + addedRules.size();
+		output.append((const char*)&attributeCount, sizeof(attributeCount));
+		for (int i = 0; i < element.attributes.size(); ++i)
+		{
+			const QPair<Record, Record> & attribute = element.attributes.at(i);
+			output.append(attribute.first.data, attribute.first.size);
+			if (newValues.at(i))
+				output.append(*newValues.at(i));
+			else
+				output.append(attribute.second.data, attribute.second.size);
+		}
+		for (const Rule * rule : addedRules)
+		{
+			output.append(rule->key);
+			output.append(rule->value);
+		}
+		copiedPos = attributesEndPos;
+		changeCount += elementChangeCount;
+	}
+
+	bool patchNode(bool isRoot)
+	{
+		const qint32 nodeType = isRoot ? 1 : read<qint32>();
+		if (nodeType != 1 && nodeType != 2)
+		{
+			printLine(QString("Error node type"));
+			return false;
+		}
+
+		Element element;
+		if (nodeType == 1)
+		{
+			const char * attributeCountPos = pos;
+			const qint32 attributeCount = read<qint32>();
+			for (int i = 0; i < attributeCount && !isFailed; ++i)
+			{
+				const Record key = readRecord();
+				const Record value = readRecord();
+				element.attributes.append(qMakePair(key, value));
+			}
+			const char * attributesEndPos = pos;
+			read<quint8>();
+			element.tagName = readRecord();
+			if (!isFailed)
+				patchAttributes(element, attributeCountPos, attributesEndPos);
+		}
+		else
+		{
+			// text nodes carry no attributes and no rule reaches below them
+			readRecord();
+			read<quint8>();
+			element.tagName = readRecord();
+		}
+
+		const qint32 childNodeCount = read<qint32>();
+		read<qint32>();		// autoId
+
+		openElements.append(element);
+		for (int i = 0; i < childNodeCount && !isFailed; ++i)
+		{
+			if (!patchNode(false))
+				return false;
+		}
+		openElements.removeLast();
+
+		if (isFailed)
+		{
+			printLine(QString("Error unexpected end of binary xml"));
+			return false;
+		}
+		return true;
+	}
+
+	const char * const begin;
+	const char * pos;
+	const char * const end;
+	const char * copiedPos;
+	bool isFailed;
+	int changeCount;
+	QVector<const Rule *> rules;
+	QVector<int> rootRuleIndexes;
+	QVector<Element> openElements;
+	QByteArray output;
+};
+
+bool XmlPatch::apply(const QByteArray & bytes, QByteArray & outBytes, int & changeCount) const
+{
+	changeCount = 0;
+	outBytes = bytes;
+	Patcher patcher(*this, bytes);
+	return patcher.run(outBytes, changeCount);
+}
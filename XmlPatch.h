@@ -0,0 +1,66 @@
+#pragma once
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// Attribute edits that are applied to the LMXBOSLB stream directly, without converting it to text and back.
+// A rule file lists the files a section applies to in brackets, followed by one rule per line:
+//
+//   [data/skill.xml]
+//   table/record[alias=Fireball]/effect@damage=120
+//
+// The path starts at the root element, * matches any tag and each [key=value] has to hold for the element of
+// that step. The attribute after @ is set on every element the path reaches and added where it is missing.
+// A section matches the path of a file or its trailing part, so [skill.xml] applies to skill.xml in any directory,
+// rules before the first section apply to every file. Empty lines and lines starting with # are ignored.
+class XmlPatch
+{
+public:
+	bool load(const QString & fileName);
+
+	bool isEmpty() const;
+	int ruleCount() const;
+
+	// the rules of all sections that apply to relativeFilePath, not thread safe
+	XmlPatch select(const QString & relativeFilePath) const;
+
+	// Copies the stream to outBytes with every rule applied and fileSize in the header updated, outBytes shares
+	// bytes when no value changes. Returns false if bytes is not a complete binary xml stream.
+	bool apply(const QByteArray & bytes, QByteArray & outBytes, int & changeCount) const;
+
+private:
+	class Patcher;
+
+	// Names and values are kept the way the stream stores them, length prefix included,
+	// so matching is a plain byte comparison and nothing has to be decoded.
+	struct Condition
+	{
+		QByteArray key;
+		QByteArray value;
+	};
+
+	struct Step
+	{
+		QByteArray tagName;
+		bool isAnyTag;
+		QVector<Condition> conditions;
+	};
+
+	struct Rule
+	{
+		QVector<Step> steps;
+		QByteArray key;
+		QByteArray value;
+	};
+
+	struct Section
+	{
+		// normalized wildcard pattern, empty for the rules before the first section
+		QString pattern;
+		QVector<Rule> rules;
+	};
+
+	static bool parseRule(const QString & line, Rule & rule);
+
+	QVector<Section> sections;
+};
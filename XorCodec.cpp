@@ -0,0 +1,113 @@
+#include "XorCodec.h"
+#include <QAtomicInteger>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XOR_CODEC_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+static const quint8 XorKey[16] = { 0xA4, 0x9F, 0xD8, 0xB3, 0xF6, 0x8E, 0x39, 0xC2, 0x2D, 0xE0, 0x61, 0x75, 0x5C, 0x4B, 0x1A, 0x07 };
+
+void xorBytesReference(quint8 * buffer, int size)
+{
+	for (int i = 0; i < size; ++i)
+		buffer[i] ^= XorKey[i % sizeof(XorKey)];
+}
+
+void xorBytes(const quint8 * src, quint8 * dst, int size)
+{
+	int i = 0;
+#if defined(__AVX2__)
+	const __m256i key256 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)XorKey));
+	for (; i + 32 <= size; i += 32)
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + i)), key256));
+#endif
+#if defined(XOR_CODEC_SSE2)
+	const __m128i key128 = _mm_loadu_si128((const __m128i*)XorKey);
+	for (; i + 16 <= size; i += 16)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), key128));
+#else
+	quint64 key64[2];
+	memcpy(key64, XorKey, sizeof(key64));
+	for (; i + 16 <= size; i += 16)
+	{
+		quint64 lanes[2];
+		memcpy(lanes, src + i, sizeof(lanes));
+		lanes[0] ^= key64[0];
+		lanes[1] ^= key64[1];
+		memcpy(dst + i, lanes, sizeof(lanes));
+	}
+#endif
+	for (; i < size; ++i)
+		dst[i] = src[i] ^ XorKey[i % sizeof(XorKey)];
+}
+
+QString decodeXorString(const char * src, int length)
+{
+	QString result(length, Qt::Uninitialized);
+	xorBytes((const quint8*)src, (quint8*)result.data(), length * 2);
+	return result;
+}
+
+void appendXorString(QByteArray & buffer, const QString & str)
+{
+	const int size = str.length() * 2;
+	const int pos = buffer.size();
+	buffer.resize(pos + size);
+	xorBytes((const quint8*)str.constData(), (quint8*)buffer.data() + pos, size);
+}
+
+static QAtomicInteger<qint64> totalInternHits;
+static QAtomicInteger<qint64> totalInternMisses;
+
+XorStringInternTable::XorStringInternTable()
+	: hits(0), misses(0)
+{
+}
+
+XorStringInternTable::~XorStringInternTable()
+{
+	totalInternHits.fetchAndAddRelaxed(hits);
+	totalInternMisses.fetchAndAddRelaxed(misses);
+}
+
+QString XorStringInternTable::decode(const char * src, int length)
+{
+	const QByteArray key = QByteArray::fromRawData(src, length * 2);
+	const QHash<QByteArray, QString>::const_iterator it = strings.constFind(key);
+	if (it != strings.constEnd())
+	{
+		++hits;
+		return it.value();
+	}
+
+	++misses;
+	const QString result = decodeXorString(src, length);
+	if (strings.size() < MaxStringCount)
+		strings.insert(QByteArray(src, length * 2), result);
+	return result;
+}
+
+qint64 XorStringInternTable::hitCount() const
+{
+	return hits;
+}
+
+qint64 XorStringInternTable::missCount() const
+{
+	return misses;
+}
+
+qint64 XorStringInternTable::totalHitCount()
+{
+	return totalInternHits.load();
+}
+
+qint64 XorStringInternTable::totalMissCount()
+{
+	return totalInternMisses.load();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+
+// Strings in binary xml are UTF-16 XORed with a 16 byte key that restarts with every string.
+
+// The original byte at a time loop, kept as reference for tests and benchmarks.
+void xorBytesReference(quint8 * buffer, int size);
+
+// XORs size bytes from src into dst, src and dst may be the same buffer.
+// Works on 16 byte (SSE2) or 32 byte (AVX2) lanes, which always line up with the key period.
+void xorBytes(const quint8 * src, quint8 * dst, int size);
+
+// Decodes length UTF-16 code units from src straight into the storage of the returned string.
+QString decodeXorString(const char * src, int length);
+
+// Appends the encoded code units of str to buffer, without a length prefix.
+void appendXorString(QByteArray & buffer, const QString & str);
+
+// Decodes repeated strings such as tag names and attribute keys only once. Lookups are keyed on the raw
+// XORed bytes, so a hit costs one hash lookup and hands out an implicitly shared copy of the decoded string.
+// A table belongs to one thread, the process wide totals are updated when it is destroyed.
+class XorStringInternTable
+{
+public:
+	XorStringInternTable();
+	~XorStringInternTable();
+
+	QString decode(const char * src, int length);
+
+	qint64 hitCount() const;
+	qint64 missCount() const;
+
+	static qint64 totalHitCount();
+	static qint64 totalMissCount();
+
+private:
+	static const int MaxStringCount = 4096;
+
+	QHash<QByteArray, QString> strings;
+	qint64 hits;
+	qint64 misses;
+};
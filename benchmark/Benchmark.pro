@@ -0,0 +1,35 @@
+TEMPLATE = app
+TARGET = MyBnsToolBenchmark
+QT += core concurrent
+CONFIG += console
+INCLUDEPATH += .. ../OpenSSL/include
+HEADERS += ./DatGenerator.h \
+    ../AesBackend.h \
+    ../AsyncFileWriter.h \
+    ../BnsArchive.h \
+    ../BnsTool.h \
+    ../DatFormat.h \
+    ../PackCache.h \
+    ../Stats.h \
+    ../TarStream.h \
+    ../Util.h \
+    ../XmlPatch.h \
+    ../XorCodec.h
+SOURCES += ./DatGenerator.cpp \
+    ./main.cpp \
+    ../AesBackend.cpp \
+    ../AsyncFileWriter.cpp \
+    ../BnsArchive.cpp \
+    ../BnsTool.cpp \
+    ../PackCache.cpp \
+    ../Stats.cpp \
+    ../TarStream.cpp \
+    ../Util.cpp \
+    ../XmlPatch.cpp \
+    ../XorCodec.cpp
+unix:LIBS += -lz
+LIBS += ../OpenSSL/lib/libcrypto.lib
+libdeflate {
+    DEFINES += USE_LIBDEFLATE
+    LIBS += -ldeflate
+}
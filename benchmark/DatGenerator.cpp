@@ -0,0 +1,218 @@
+#include "DatGenerator.h"
+#include <QBuffer>
+#include <QFile>
+#include <QFileInfo>
+#include <cmath>
+#include <cstring>
+#include "DatFormat.h"
+
+// splitmix64, small and fast with good enough statistics, and identical on every platform unlike qrand()
+class Random
+{
+public:
+	explicit Random(quint64 seed)
+		: state(seed)
+	{
+	}
+
+	quint64 next()
+	{
+		quint64 z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	// in [minValue, maxValue]
+	qint64 uniform(qint64 minValue, qint64 maxValue)
+	{
+		return minValue + (qint64)(next() % (quint64)(maxValue - minValue + 1));
+	}
+
+	// in [0, 1)
+	double real()
+	{
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+private:
+	quint64 state;
+};
+
+static const char * const Words[] = {
+	"table", "record", "item", "skill", "effect", "npc", "quest", "zone", "text", "icon",
+	"alias", "name", "level", "grade", "type", "value", "min", "max", "rate", "id",
+};
+static const int WordCount = sizeof(Words) / sizeof(Words[0]);
+
+QJsonObject DatGeneratorProfile::toJson() const
+{
+	QJsonObject object;
+	object["seed"] = QString::number(seed);
+	object["fileCount"] = fileCount;
+	object["minFileSize"] = (double)minFileSize;
+	object["maxFileSize"] = (double)maxFileSize;
+	object["xmlRatio"] = xmlRatio;
+	object["compressibility"] = compressibility;
+	object["xmlDepth"] = xmlDepth;
+	object["xmlChildCount"] = xmlChildCount;
+	object["xmlAttributeCount"] = xmlAttributeCount;
+	return object;
+}
+
+DatGenerator::DatGenerator(const DatGeneratorProfile & profile)
+	: profile(profile)
+{
+}
+
+static bool isXmlFile(const DatGeneratorProfile & profile, int index)
+{
+	return Random(profile.seed * 31 + index).real() < profile.xmlRatio;
+}
+
+QString DatGenerator::relativeFilePath(int index) const
+{
+	// a few hundred files per directory, two levels deep
+	const QString extension = isXmlFile(profile, index) ? "xml" : "bin";
+	return QString("dir%1/sub%2/file%3.%4").arg(index / 4096).arg(index / 256 % 16).arg(index).arg(extension);
+}
+
+static void appendXmlElement(const DatGeneratorProfile & profile, Random & random, QByteArray & out, int depth, qint64 targetSize)
+{
+	const char * tagName = Words[random.uniform(0, WordCount - 1)];
+	out.append(QByteArray(depth, '\t'));
+	out.append('<').append(tagName);
+	for (int i = 0; i < profile.xmlAttributeCount; ++i)
+	{
+		// numbered keys keep attributes unique within an element
+		out.append(' ').append(Words[random.uniform(0, WordCount - 1)]).append(QByteArray::number(i));
+		out.append("=\"");
+		if (random.real() < 0.5)
+			out.append(QByteArray::number(random.uniform(0, 1000000)));
+		else
+			out.append(Words[random.uniform(0, WordCount - 1)]).append('_').append(Words[random.uniform(0, WordCount - 1)]);
+		out.append('"');
+	}
+
+	const int childCount = (depth + 1 < profile.xmlDepth) ? (int)random.uniform(0, profile.xmlChildCount) : 0;
+	if (childCount == 0 || out.size() >= targetSize)
+	{
+		out.append("/>\n");
+		return;
+	}
+	out.append(">\n");
+	for (int i = 0; i < childCount && out.size() < targetSize; ++i)
+		appendXmlElement(profile, random, out, depth + 1, targetSize);
+	out.append(QByteArray(depth, '\t'));
+	out.append("</").append(tagName).append(">\n");
+}
+
+QByteArray DatGenerator::fileData(int index) const
+{
+	Random random(profile.seed * 0x100000001B3ULL + index);
+	const double logMinSize = std::log((double)qMax<qint64>(1, profile.minFileSize));
+	const double logMaxSize = std::log((double)qMax(profile.minFileSize, profile.maxFileSize));
+	const qint64 targetSize = (qint64)std::exp(logMinSize + (logMaxSize - logMinSize) * random.real());
+
+	QByteArray data;
+	if (isXmlFile(profile, index))
+	{
+		data.reserve(targetSize + 1024);
+		data.append("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<table version=\"1\">\n");
+		while (data.size() < targetSize)
+			appendXmlElement(profile, random, data, 1, targetSize);
+		data.append("</table>\n");
+		return data;
+	}
+
+	// random blocks with a given share of them repeated, which puts the deflate ratio somewhere useful
+	const int BlockSize = 64;
+	data.resize(targetSize);
+	for (qint64 pos = 0; pos < targetSize; pos += BlockSize)
+	{
+		const int blockSize = (int)qMin<qint64>(BlockSize, targetSize - pos);
+		if (pos >= BlockSize && random.real() < profile.compressibility)
+		{
+			const qint64 sourcePos = random.uniform(0, pos / BlockSize - 1) * BlockSize;
+			memcpy(data.data() + pos, data.constData() + sourcePos, blockSize);
+		}
+		else
+		{
+			for (int i = 0; i < blockSize; i += 8)
+			{
+				const quint64 value = random.next();
+				memcpy(data.data() + pos + i, &value, qMin(8, blockSize - i));
+			}
+		}
+	}
+	return data;
+}
+
+bool DatGenerator::writeDirectory(const QDir & dir, qint64 * outTotalSize) const
+{
+	qint64 totalSize = 0;
+	for (int i = 0; i < profile.fileCount; ++i)
+	{
+		const QString filePath = dir.filePath(relativeFilePath(i));
+		QDir().mkpath(QFileInfo(filePath).path());
+		QFile file(filePath);
+		const QByteArray data = fileData(i);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(data) != data.size())
+			return false;
+		totalSize += data.size();
+	}
+	if (outTotalSize)
+		*outTotalSize = totalSize;
+	return true;
+}
+
+bool DatGenerator::writeSparseDat(const QString & fileName, int fileCount, qint64 firstDataOffset, qint64 gapSize) const
+{
+	DatFileHeader<8> header;
+	header.init();
+	header.isCompressed = true;
+	header.isEncrypted = true;
+
+	QVector<QByteArray> packedFileDatas;
+	QVector<qint64> dataOffsets;
+	QBuffer fileTableStream;
+	fileTableStream.open(QIODevice::WriteOnly);
+	qint64 dataOffset = firstDataOffset;
+	for (int i = 0; i < qMin(fileCount, profile.fileCount); ++i)
+	{
+		const QByteArray data = fileData(i);
+		DatFileTableItem<8> fileItem = DatFileTableItem<8>();
+		fileItem.unknown1 = 2;
+		fileItem.isCompressed = true;
+		fileItem.isEncrypted = true;
+		qint32 intermediateSize = 0;
+		packedFileDatas.append(BnsTool::pack(data, fileItem.isEncrypted, fileItem.isCompressed, &intermediateSize));
+		fileItem.unpackedSize = data.size();
+		fileItem.intermediateSize = intermediateSize;
+		fileItem.packedSize = packedFileDatas.last().size();
+		fileItem.dataOffset = dataOffset;
+		dataOffsets.append(dataOffset);
+		dataOffset += fileItem.packedSize + gapSize;
+
+		streamAutoWriteString<8>(&fileTableStream, QString(relativeFilePath(i)).replace('/', '\\'), false);
+		fileTableStream.write((const char*)&fileItem, sizeof(fileItem));
+		header.fileCount++;
+		header.totalFileIntermediateSize += intermediateSize;
+	}
+	fileTableStream.close();
+	if (packedFileDatas.isEmpty())
+		return false;
+
+	const QByteArray packedFileTable = BnsTool::pack(fileTableStream.data(), header.isEncrypted, header.isCompressed);
+	header.unpackedFileTableSize = fileTableStream.data().size();
+	header.packedFileTableSize = packedFileTable.size();
+	const qint64 dataBeginPos = sizeof(header) + packedFileTable.size() + sizeof(qint64);
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+	bool isWritten = streamWrite(&file, header) && file.write(packedFileTable) == packedFileTable.size() && streamWrite<qint64>(&file, dataBeginPos);
+	for (int i = 0; i < packedFileDatas.size() && isWritten; ++i)
+		isWritten = file.seek(dataBeginPos + dataOffsets.at(i)) && file.write(packedFileDatas.at(i)) == packedFileDatas.at(i).size();
+	return isWritten;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <QByteArray>
+#include <QDir>
+#include <QJsonObject>
+#include <QString>
+
+// Describes a synthetic archive. Everything generated follows from these values alone,
+// so two runs with the same profile produce byte identical inputs.
+struct DatGeneratorProfile
+{
+	quint64 seed = 1;
+	int fileCount = 2000;
+	// file sizes are log-uniformly distributed, like the mix of small xml and large assets in real dat files
+	qint64 minFileSize = 256;
+	qint64 maxFileSize = 256 * 1024;
+	// share of files generated as text xml, the rest is binary data
+	double xmlRatio = 0.5;
+	// share of 64 byte blocks in binary files that repeat an earlier block instead of being random
+	double compressibility = 0.7;
+	int xmlDepth = 4;
+	int xmlChildCount = 6;
+	int xmlAttributeCount = 4;
+
+	QJsonObject toJson() const;
+};
+
+class DatGenerator
+{
+public:
+	explicit DatGenerator(const DatGeneratorProfile & profile);
+
+	// Files are independent of each other, fileData(i) may be called in any order and from any thread.
+	QString relativeFilePath(int index) const;
+	QByteArray fileData(int index) const;
+
+	// Writes all files below dir, the layout compress expects. Returns false on write errors.
+	bool writeDirectory(const QDir & dir, qint64 * outTotalSize = nullptr) const;
+
+	// Writes a 64-bit dat holding the first fileCount files, packed the way compress packs them. The data of the first file
+	// starts at dataOffset firstDataOffset and every following file gapSize bytes after the end of the previous one.
+	// The gaps are never written, so on file systems with sparse files the dat takes little more than its content on disk.
+	bool writeSparseDat(const QString & fileName, int fileCount, qint64 firstDataOffset, qint64 gapSize) const;
+
+private:
+	const DatGeneratorProfile profile;
+};
@@ -0,0 +1,505 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTemporaryDir>
+#include <QtConcurrentMap>
+#include <limits>
+#include "AesBackend.h"
+#include "BnsArchive.h"
+#include "BnsTool.h"
+#include "DatGenerator.h"
+#include "Util.h"
+#include "XorCodec.h"
+
+static const qint64 BytesPerMeasurement = 256 * 1024 * 1024;
+
+template <class Function>
+static double measureThroughput(qint64 bufferSize, Function function)
+{
+	const qint64 iterationCount = qMax<qint64>(1, BytesPerMeasurement / bufferSize);
+	QElapsedTimer timer;
+	timer.start();
+	for (qint64 i = 0; i < iterationCount; ++i)
+		function();
+	const double seconds = qMax<qint64>(1, timer.nsecsElapsed()) / 1e9;
+	return iterationCount * bufferSize / seconds / (1024 * 1024);
+}
+
+// Collects every measurement for the json report and prints it as it comes in.
+class BenchmarkReport
+{
+public:
+	void addSpeed(const QString & name, double megabytesPerSecond)
+	{
+		QJsonObject result;
+		result["name"] = name;
+		result["mbPerSecond"] = megabytesPerSecond;
+		results.append(result);
+		printLine(QString("%1: %2 MB/s").arg(name).arg(megabytesPerSecond, 0, 'f', 1));
+	}
+
+	void addRun(const QString & name, qint64 bytes, qint64 fileCount, qint64 nanoseconds)
+	{
+		const double seconds = qMax<qint64>(1, nanoseconds) / 1e9;
+		QJsonObject result;
+		result["name"] = name;
+		result["bytes"] = (double)bytes;
+		result["files"] = (double)fileCount;
+		result["seconds"] = seconds;
+		result["mbPerSecond"] = bytes / seconds / (1024 * 1024);
+		result["filesPerSecond"] = fileCount / seconds;
+		results.append(result);
+		printLine(QString("%1: %2 MB/s, %3 files/s").arg(name)
+			.arg(bytes / seconds / (1024 * 1024), 0, 'f', 1).arg(fileCount / seconds, 0, 'f', 0));
+	}
+
+	QJsonArray toJson() const
+	{
+		return results;
+	}
+
+private:
+	QJsonArray results;
+};
+
+static bool benchmarkAes(BenchmarkReport & report)
+{
+	const QList<AesBackend *> backends = AesBackend::availableBackends();
+
+	QByteArray plainText(1024 * 1024, Qt::Uninitialized);
+	for (int i = 0; i < plainText.size(); ++i)
+		plainText[i] = (char)(i * 131 + 7);
+
+	// every backend has to produce the same cipher text before its speed means anything
+	QByteArray expectedCipherText;
+	for (AesBackend * backend : backends)
+	{
+		QByteArray cipherText(plainText.size(), Qt::Uninitialized);
+		backend->encrypt((const uchar*)plainText.constData(), (uchar*)cipherText.data(), plainText.size());
+		if (expectedCipherText.isEmpty())
+			expectedCipherText = cipherText;
+		if (cipherText != expectedCipherText)
+		{
+			printLine(QString("Error! aes backend %1 produces different output").arg(backend->name()));
+			return false;
+		}
+	}
+
+	const qint64 bufferSizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+	for (AesBackend * backend : backends)
+	{
+		for (const qint64 bufferSize : bufferSizes)
+		{
+			QByteArray buffer = plainText.left(bufferSize);
+			uchar * bufferPtr = (uchar*)buffer.data();
+			const double encryptSpeed = measureThroughput(bufferSize, [&]() { backend->encrypt(bufferPtr, bufferPtr, bufferSize); });
+			const double decryptSpeed = measureThroughput(bufferSize, [&]() { backend->decrypt(bufferPtr, bufferPtr, bufferSize); });
+			report.addSpeed(QString("aes.%1.encrypt.%2").arg(backend->name()).arg(bufferSize), encryptSpeed);
+			report.addSpeed(QString("aes.%1.decrypt.%2").arg(backend->name()).arg(bufferSize), decryptSpeed);
+		}
+	}
+	return true;
+}
+
+static bool benchmarkXor(BenchmarkReport & report)
+{
+	const int StringCount = 4096;
+	const int stringLengths[] = { 8, 32, 256 };
+	volatile ushort sink = 0;
+	for (const int length : stringLengths)
+	{
+		const int stringSize = length * 2;
+		QByteArray encoded(StringCount * stringSize, Qt::Uninitialized);
+		for (int i = 0; i < encoded.size(); ++i)
+			encoded[i] = (char)(i * 37 + length);
+
+		for (int i = 0; i < StringCount; ++i)
+		{
+			QByteArray reference(encoded.constData() + i * stringSize, stringSize);
+			xorBytesReference((quint8*)reference.data(), stringSize);
+			if (decodeXorString(encoded.constData() + i * stringSize, length) != QString::fromUtf16((const ushort*)reference.constData(), length))
+			{
+				printLine(QString("Error! xor codec differs from reference at length %1").arg(length));
+				return false;
+			}
+		}
+
+		// the routine binary xml strings used to go through: read into a QByteArray, copy into a QString, XOR in place
+		const double referenceDecodeSpeed = measureThroughput(encoded.size(), [&]()
+		{
+			for (int i = 0; i < StringCount; ++i)
+			{
+				const QByteArray bytes(encoded.constData() + i * stringSize, stringSize);
+				QString str = QString::fromUtf16((const ushort*)bytes.constData(), length);
+				xorBytesReference((quint8*)str.data(), stringSize);
+				sink += str.at(0).unicode();
+			}
+		});
+		const double decodeSpeed = measureThroughput(encoded.size(), [&]()
+		{
+			for (int i = 0; i < StringCount; ++i)
+				sink += decodeXorString(encoded.constData() + i * stringSize, length).at(0).unicode();
+		});
+
+		const QString str = decodeXorString(encoded.constData(), length);
+		QByteArray output;
+		output.reserve(StringCount * stringSize);
+		const double referenceEncodeSpeed = measureThroughput(encoded.size(), [&]()
+		{
+			output.resize(0);
+			for (int i = 0; i < StringCount; ++i)
+			{
+				QByteArray temp((const char*)str.constData(), stringSize);
+				xorBytesReference((quint8*)temp.data(), stringSize);
+				output.append(temp);
+			}
+		});
+		const double encodeSpeed = measureThroughput(encoded.size(), [&]()
+		{
+			output.resize(0);
+			for (int i = 0; i < StringCount; ++i)
+				appendXorString(output, str);
+		});
+
+		report.addSpeed(QString("xor.decode.reference.%1").arg(length), referenceDecodeSpeed);
+		report.addSpeed(QString("xor.decode.codec.%1").arg(length), decodeSpeed);
+		report.addSpeed(QString("xor.encode.reference.%1").arg(length), referenceEncodeSpeed);
+		report.addSpeed(QString("xor.encode.codec.%1").arg(length), encodeSpeed);
+	}
+	return true;
+}
+
+// Runs every in-memory stage of extract and compress on one thread, over the first sampleSize bytes of generated files.
+static bool benchmarkStages(const DatGenerator & generator, const DatGeneratorProfile & profile, qint64 sampleSize, BenchmarkReport & report)
+{
+	QVector<QByteArray> textXmls;
+	QVector<QByteArray> fileDatas;
+	qint64 totalSize = 0;
+	for (int i = 0; i < profile.fileCount && totalSize < sampleSize; ++i)
+	{
+		const QByteArray data = generator.fileData(i);
+		if (data.startsWith("<?xml"))
+			textXmls.append(data);
+		else
+			fileDatas.append(data);
+		totalSize += data.size();
+	}
+
+	QElapsedTimer timer;
+	qint64 textXmlSize = 0;
+	QVector<QByteArray> binXmls;
+	timer.start();
+	for (const QByteArray & textXml : textXmls)
+	{
+		binXmls.append(BnsTool::xmlText2Bin(textXml));
+		textXmlSize += textXml.size();
+	}
+	report.addRun("stage.xmlText2Bin", textXmlSize, textXmls.size(), timer.nsecsElapsed());
+
+	qint64 binXmlSize = 0;
+	timer.start();
+	for (const QByteArray & binXml : binXmls)
+	{
+		if (BnsTool::xmlBin2Text(binXml).isEmpty())
+		{
+			printLine("Error! generated xml does not convert back");
+			return false;
+		}
+		binXmlSize += binXml.size();
+	}
+	report.addRun("stage.xmlBin2Text", binXmlSize, binXmls.size(), timer.nsecsElapsed());
+
+	// what compress packs: binary files as they are and xml after conversion
+	fileDatas += binXmls;
+	qint64 fileDataSize = 0;
+	for (const QByteArray & fileData : fileDatas)
+		fileDataSize += fileData.size();
+
+	const BnsTool::CompressionLevel levels[] = { BnsTool::FastLevel, BnsTool::DefaultLevel, BnsTool::MaxLevel };
+	const char * const levelNames[] = { "fast", "default", "max" };
+	QVector<QByteArray> packedFileDatas;
+	QVector<bool> isCompressedList;
+	for (int levelIndex = 0; levelIndex < 3; ++levelIndex)
+	{
+		packedFileDatas.clear();
+		isCompressedList.clear();
+		qint64 packedSize = 0;
+		timer.start();
+		for (const QByteArray & fileData : fileDatas)
+		{
+			bool isCompressed = true;
+			packedFileDatas.append(BnsTool::pack(fileData, true, true, nullptr, levels[levelIndex], &isCompressed));
+			isCompressedList.append(isCompressed);
+			packedSize += packedFileDatas.last().size();
+		}
+		report.addRun(QString("stage.pack.%1").arg(levelNames[levelIndex]), fileDataSize, fileDatas.size(), timer.nsecsElapsed());
+		printLine(QString("  ratio %1").arg((double)packedSize / qMax<qint64>(1, fileDataSize), 0, 'f', 3));
+	}
+
+	// unpacks what the max level produced
+	timer.start();
+	for (int i = 0; i < packedFileDatas.size(); ++i)
+	{
+		if (BnsTool::unpack(packedFileDatas.at(i), fileDatas.at(i).size(), true, isCompressedList.at(i)) != fileDatas.at(i))
+		{
+			printLine("Error! unpack does not restore packed data");
+			return false;
+		}
+	}
+	report.addRun("stage.unpack", fileDataSize, fileDatas.size(), timer.nsecsElapsed());
+	return true;
+}
+
+// Reads every entry back through BnsArchive, from all threads at once, and compares it with what the generator produced.
+static bool verifyArchive(const DatGenerator & generator, const DatGeneratorProfile & profile, const QString & datFilePath)
+{
+	BnsArchive archive;
+	if (!archive.open(datFilePath))
+		return false;
+	if (archive.entryCount() != profile.fileCount)
+	{
+		printLine(QString("Error! %1 has %2 entries instead of %3").arg(datFilePath).arg(archive.entryCount()).arg(profile.fileCount));
+		return false;
+	}
+
+	QVector<int> fileIndexes(profile.fileCount);
+	for (int i = 0; i < fileIndexes.size(); ++i)
+		fileIndexes[i] = i;
+	QAtomicInt failedCount(0);
+	QtConcurrent::blockingMap(fileIndexes, [&](int fileIndex)
+	{
+		QByteArray expectedData = generator.fileData(fileIndex);
+		if (expectedData.startsWith("<?xml"))
+			expectedData = BnsTool::xmlText2Bin(expectedData);
+		if (archive.readUnpacked(generator.relativeFilePath(fileIndex)) != expectedData)
+		{
+			printLine(QString("Error! %1 differs in %2").arg(generator.relativeFilePath(fileIndex)).arg(datFilePath));
+			failedCount.fetchAndAddRelaxed(1);
+		}
+	});
+	printLine(QString("Verified %1 entries of %2 (%3 bytes)").arg(archive.entryCount()).arg(datFilePath).arg(QFileInfo(datFilePath).size()));
+	return failedCount.load() == 0;
+}
+
+// Reads a sparse 64-bit dat whose data offsets lie beyond 2 and 4 GB back through BnsArchive and extract64,
+// which catches offsets, sizes or counts narrowed to 32 bits anywhere between the table and the data.
+static bool verifyLargeOffsets(const DatGenerator & generator, const DatGeneratorProfile & profile, int threadCount, const QDir & workDir)
+{
+	const int fileCount = qMin(profile.fileCount, 16);
+	const qint64 firstDataOffset = 3LL * 1024 * 1024 * 1024;
+	const qint64 gapSize = 256 * 1024 * 1024;
+	const QString datFilePath = workDir.filePath("largeOffsets64.dat");
+	if (!generator.writeSparseDat(datFilePath, fileCount, firstDataOffset, gapSize))
+	{
+		printLine(QString("Error! writing %1 failed").arg(datFilePath));
+		QFile::remove(datFilePath);
+		return false;
+	}
+
+	int failedCount = 0;
+	qint64 maxDataOffset = 0;
+	{
+		BnsArchive archive;
+		if (!archive.open(datFilePath) || archive.entryCount() != fileCount)
+		{
+			printLine(QString("Error! %1 has %2 entries instead of %3").arg(datFilePath).arg(archive.entryCount()).arg(fileCount));
+			QFile::remove(datFilePath);
+			return false;
+		}
+		for (int i = 0; i < fileCount; ++i)
+		{
+			const BnsArchive::Entry * entry = archive.entry(generator.relativeFilePath(i));
+			if (!entry || archive.readUnpacked(*entry) != generator.fileData(i))
+			{
+				printLine(QString("Error! %1 differs in %2").arg(generator.relativeFilePath(i)).arg(datFilePath));
+				failedCount++;
+				continue;
+			}
+			maxDataOffset = qMax(maxDataOffset, entry->dataOffset);
+		}
+	}
+
+	QDir outDir(workDir.filePath("largeOffsets64"));
+	BnsTool::ExtractOptions extractOptions;
+	extractOptions.threadCount = threadCount;
+	setPrintLineEnabled(false);
+	QFile inFile(datFilePath);
+	const bool isExtracted = BnsTool::extract64(&inFile, outDir, extractOptions);
+	inFile.close();
+	setPrintLineEnabled(true);
+	for (int i = 0; i < fileCount && isExtracted; ++i)
+	{
+		QFile file(outDir.filePath(generator.relativeFilePath(i)));
+		if (!file.open(QIODevice::ReadOnly) || file.readAll() != generator.fileData(i))
+		{
+			printLine(QString("Error! %1 differs after extract64 of %2").arg(generator.relativeFilePath(i)).arg(datFilePath));
+			failedCount++;
+		}
+	}
+	if (!isExtracted)
+		printLine(QString("Error! extract64 of %1 failed").arg(datFilePath));
+	outDir.removeRecursively();
+	QFile::remove(datFilePath);
+
+	if (!isExtracted || failedCount > 0)
+		return false;
+	printLine(QString("Verified %1 entries at data offsets up to %2").arg(fileCount).arg(maxDataOffset));
+	return true;
+}
+
+// End to end compress and extract of a generated directory, all rates relative to the generated input size.
+static bool benchmarkArchive(const DatGenerator & generator, const DatGeneratorProfile & profile, const QDir & inputDir, qint64 inputSize,
+	bool is64, int threadCount, bool verify, const QDir & workDir, BenchmarkReport & report)
+{
+	const QString prefix = is64 ? "archive64" : "archive32";
+	const QString datFilePath = workDir.filePath(prefix + ".dat");
+
+	QElapsedTimer timer;
+	setPrintLineEnabled(false);
+	BnsTool::CompressOptions compressOptions;
+	compressOptions.threadCount = threadCount;
+	timer.start();
+	QFile outFile(datFilePath);
+	const bool isCompressed = is64 ? BnsTool::compress64(inputDir, &outFile, compressOptions) : BnsTool::compress(inputDir, &outFile, compressOptions);
+	outFile.close();
+	const qint64 compressTime = timer.nsecsElapsed();
+	setPrintLineEnabled(true);
+	if (!isCompressed)
+	{
+		printLine(QString("Error! %1 compress failed").arg(prefix));
+		return false;
+	}
+	report.addRun(prefix + ".compress", inputSize, profile.fileCount, compressTime);
+
+	if (verify && !verifyArchive(generator, profile, datFilePath))
+		return false;
+
+	const bool convertXmlModes[] = { false, true };
+	for (const bool convertXml : convertXmlModes)
+	{
+		const QString name = prefix + (convertXml ? ".extractXml" : ".extract");
+		QDir outDir(workDir.filePath(name));
+		BnsTool::ExtractOptions extractOptions;
+		extractOptions.threadCount = threadCount;
+		extractOptions.convertXml = convertXml;
+
+		setPrintLineEnabled(false);
+		timer.start();
+		QFile inFile(datFilePath);
+		const bool isExtracted = is64 ? BnsTool::extract64(&inFile, outDir, extractOptions) : BnsTool::extract(&inFile, outDir, extractOptions);
+		inFile.close();
+		const qint64 extractTime = timer.nsecsElapsed();
+		setPrintLineEnabled(true);
+		if (!isExtracted)
+		{
+			printLine(QString("Error! %1 failed").arg(name));
+			return false;
+		}
+		report.addRun(name, inputSize, profile.fileCount, extractTime);
+		outDir.removeRecursively();
+	}
+	QFile::remove(datFilePath);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	QCoreApplication app(argc, argv);
+
+	QStringList argumentList = app.arguments();
+	argumentList.removeFirst();
+
+	DatGeneratorProfile profile;
+	profile.seed = takeOption(argumentList, "--seed", "1").toULongLong();
+	profile.fileCount = takeOption(argumentList, "--files", QString::number(profile.fileCount)).toInt();
+	profile.minFileSize = takeOption(argumentList, "--min-size", QString::number(profile.minFileSize)).toLongLong();
+	profile.maxFileSize = takeOption(argumentList, "--max-size", QString::number(profile.maxFileSize)).toLongLong();
+	profile.xmlRatio = takeOption(argumentList, "--xml-ratio", QString::number(profile.xmlRatio)).toDouble();
+	profile.compressibility = takeOption(argumentList, "--compressibility", QString::number(profile.compressibility)).toDouble();
+	profile.xmlDepth = takeOption(argumentList, "--xml-depth", QString::number(profile.xmlDepth)).toInt();
+	profile.xmlChildCount = takeOption(argumentList, "--xml-children", QString::number(profile.xmlChildCount)).toInt();
+	profile.xmlAttributeCount = takeOption(argumentList, "--xml-attributes", QString::number(profile.xmlAttributeCount)).toInt();
+	const qint64 sampleSize = takeOption(argumentList, "--sample-mb", "64").toLongLong() * 1024 * 1024;
+	const int threadCount = resolveThreadCount(takeOption(argumentList, "-j", "0").toInt());
+	const QString jsonFileName = takeOption(argumentList, "--json");
+	const QString workDirName = takeOption(argumentList, "--work-dir");
+	const bool skipMicro = takeFlag(argumentList, "--skip-micro");
+	const bool skipStages = takeFlag(argumentList, "--skip-stages");
+	const bool skipArchive = takeFlag(argumentList, "--skip-archive");
+	const bool verify = takeFlag(argumentList, "--verify");
+	const bool verifyOffsets = takeFlag(argumentList, "--large-offsets");
+	if (!argumentList.isEmpty())
+	{
+		printLine(QString("Unknown arguments %1").arg(argumentList.join(' ')));
+		return 1;
+	}
+
+	BenchmarkReport report;
+	if (!skipMicro)
+	{
+		if (!benchmarkAes(report))
+			return 1;
+		if (!benchmarkXor(report))
+			return 1;
+	}
+
+	const DatGenerator generator(profile);
+	if (!skipStages && !benchmarkStages(generator, profile, sampleSize, report))
+		return 1;
+
+	QTemporaryDir temporaryDir;
+	const QDir workDir(workDirName.isEmpty() ? temporaryDir.path() : workDirName);
+	workDir.mkpath(".");
+	if (verifyOffsets && !verifyLargeOffsets(generator, profile, threadCount, workDir))
+		return 1;
+
+	if (!skipArchive)
+	{
+		QDir inputDir(workDir.filePath("input"));
+		qint64 inputSize = 0;
+		printLine(QString("Generating %1 files in %2").arg(profile.fileCount).arg(inputDir.path()));
+		if (!generator.writeDirectory(inputDir, &inputSize))
+		{
+			printLine("Error! writing generated files failed");
+			return 1;
+		}
+		QElapsedTimer scanTimer;
+		scanTimer.start();
+		const QVector<ScannedFile> scannedFiles = scanFiles(inputDir, threadCount);
+		report.addRun("stage.scan", inputSize, scannedFiles.size(), scanTimer.nsecsElapsed());
+
+		// a 32-bit dat can not hold more than 2 GB of packed data, so very large inputs are only packed as 64-bit
+		if (inputSize < std::numeric_limits<qint32>::max())
+		{
+			if (!benchmarkArchive(generator, profile, inputDir, inputSize, false, threadCount, verify, workDir, report))
+				return 1;
+		}
+		else
+		{
+			printLine(QString("Skipping 32-bit archive, input is %1 bytes").arg(inputSize));
+		}
+		if (!benchmarkArchive(generator, profile, inputDir, inputSize, true, threadCount, verify, workDir, report))
+			return 1;
+		inputDir.removeRecursively();
+	}
+
+	if (!jsonFileName.isEmpty())
+	{
+		QJsonObject root;
+		root["profile"] = profile.toJson();
+		root["threadCount"] = threadCount;
+		root["aesBackend"] = AesBackend::current()->name();
+		root["compressionBackend"] = BnsTool::compressionBackendName();
+		root["results"] = report.toJson();
+		QFile jsonFile(jsonFileName);
+		if (!jsonFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			printLine(QString("Error! can not write %1").arg(jsonFileName));
+			return 1;
+		}
+		jsonFile.write(QJsonDocument(root).toJson());
+	}
+	return 0;
+}
@@ -1,9 +1,20 @@
 #include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
 #include <QtDebug>
 #include <QTextCodec>
+#include <cstdio>
 #include <iostream>
+#include <limits>
+#ifdef Q_OS_WIN
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "AesBackend.h"
 #include "BnsTool.h"
+#include "Stats.h"
 #include "Util.h"
+#include "XmlPatch.h"
 
 void printHelp()
 {
@@ -13,29 +24,117 @@ void printHelp()
 	std::cout << helpText.toLocal8Bit().data();
 }
 
+// Standard streams carry tar data in pipe mode, Windows must not translate line ends in them.
+static bool openStandardStream(QFile & file, FILE * stream, QIODevice::OpenMode mode)
+{
+#ifdef Q_OS_WIN
+	_setmode(_fileno(stream), _O_BINARY);
+#endif
+	return file.open(stream, mode);
+}
+
 int main(int argc, char *argv[])
 {
 	QCoreApplication app(argc, argv);
 
 	QStringList argumentList = app.arguments();
 	argumentList.removeFirst();
+	const QString threadCountText = takeOption(argumentList, "-j", "1");
+	bool isThreadCountValid = false;
+	const int threadCount = threadCountText.toInt(&isThreadCountValid);
+	if (!isThreadCountValid || threadCount < 0)
+	{
+		printLine(QString("Invalid thread count %1, expected 0 or more").arg(threadCountText));
+		return 1;
+	}
+	const bool noFileMapping = takeFlag(argumentList, "--no-mmap");
+	const bool streamOutput = takeFlag(argumentList, "--stream");
+	const bool deduplicate = takeFlag(argumentList, "--dedup");
+	const QString aesBackendName = takeOption(argumentList, "--aes");
+	const QStringList onlyPatterns = takeOptions(argumentList, "--only");
+	const QString baseFileName = takeOption(argumentList, "--base");
+	const QString cacheDirName = takeOption(argumentList, "--cache");
+	const QString maxCacheSizeText = takeOption(argumentList, "--cache-size", "1024");
+	bool isMaxCacheSizeValid = false;
+	const qint64 maxCacheSizeMegabytes = maxCacheSizeText.toLongLong(&isMaxCacheSizeValid);
+	if (!isMaxCacheSizeValid || maxCacheSizeMegabytes < 0 || maxCacheSizeMegabytes > std::numeric_limits<qint64>::max() / (1024 * 1024))
+	{
+		printLine(QString("Invalid cache size %1, expected a number of MB, 0 for no limit").arg(maxCacheSizeText));
+		return 1;
+	}
+	const qint64 maxCacheSize = maxCacheSizeMegabytes * 1024 * 1024;
+	BnsTool::CompressionLevel compressionLevel = BnsTool::DefaultLevel;
+	const QString compressionLevelName = takeOption(argumentList, "--level");
+	if (!compressionLevelName.isEmpty() && !BnsTool::parseCompressionLevel(compressionLevelName, compressionLevel))
+	{
+		printLine(QString("Unknown compression level %1").arg(compressionLevelName));
+		return 1;
+	}
+	QList<QPair<QString, BnsTool::CompressionLevel>> compressionLevelOverrides;
+	for (const QString & levelOverride : takeOptions(argumentList, "--level-for"))
+	{
+		const int separatorIndex = levelOverride.lastIndexOf('=');
+		BnsTool::CompressionLevel level;
+		if (separatorIndex <= 0 || !BnsTool::parseCompressionLevel(levelOverride.mid(separatorIndex + 1), level))
+		{
+			printLine(QString("Invalid --level-for %1, expected <pattern>=<level>").arg(levelOverride));
+			return 1;
+		}
+		compressionLevelOverrides.append(qMakePair(levelOverride.left(separatorIndex), level));
+	}
+	if (!aesBackendName.isEmpty() && !AesBackend::select(aesBackendName))
+	{
+		printLine(QString("Unknown aes backend %1").arg(aesBackendName));
+		return 1;
+	}
+	const QString statsJsonFileName = takeOption(argumentList, "--stats-json");
+	const int slowestEntryCount = takeOption(argumentList, "--stats-top", "10").toInt();
+	const bool printStats = takeFlag(argumentList, "--stats");
+	Stats::setEnabled(printStats || !statsJsonFileName.isEmpty(), slowestEntryCount);
 	if (argumentList.size() < 2)
 	{
 		printHelp();
 		return 0;
 	}
 
+	QElapsedTimer wallTimer;
+	wallTimer.start();
+
+	int exitCode = 0;
 	const QString instruction = argumentList.at(0);
-	if (instruction == "-e" || instruction == "-x" || instruction == "-e64" || instruction == "-x64")
+	if (instruction == "-l" || instruction == "-l64")
+	{
+		const QString inFileName = argumentList.at(1);
+		const bool isListed = instruction.endsWith("64") ? BnsTool::list64(&QFile(inFileName)) : BnsTool::list(&QFile(inFileName));
+		if (!isListed)
+			exitCode = 1;
+	}
+	else if (instruction == "-e" || instruction == "-x" || instruction == "-e64" || instruction == "-x64")
 	{
 		const bool convertXml = (instruction == "-x") || (instruction == "-x64");
 		const bool is64 = instruction.endsWith("64");
 		const QString inFileName = argumentList.at(1);
 		const QString outDirName = (argumentList.size() >= 3) ? argumentList.at(2) : (inFileName + ".files");
+		BnsTool::ExtractOptions options;
+		options.convertXml = convertXml;
+		options.threadCount = threadCount;
+		options.useFileMapping = !noFileMapping;
+		options.onlyPatterns = onlyPatterns;
+		// "-" writes a tar stream to stdout, so messages go to stderr
+		QFile tarOutput;
+		if (outDirName == "-")
+		{
+			setPrintLineToStderr(true);
+			openStandardStream(tarOutput, stdout, QIODevice::WriteOnly);
+			options.tarOutput = &tarOutput;
+		}
+		bool isExtracted = false;
 		if(is64)
-			BnsTool::extract64(&QFile(inFileName), QDir(outDirName), convertXml);
+			isExtracted = BnsTool::extract64(&QFile(inFileName), QDir(outDirName), options);
 		else
-			BnsTool::extract(&QFile(inFileName), QDir(outDirName), convertXml);
+			isExtracted = BnsTool::extract(&QFile(inFileName), QDir(outDirName), options);
+		if (!isExtracted)
+			exitCode = 1;
 	}
 	else if (instruction == "-c" || instruction == "-c64")
 	{
@@ -45,22 +144,144 @@ int main(int argc, char *argv[])
 		const QString outFileName = (argumentList.size() >= 3) ? argumentList.at(2) : associatedOutFileName;
 		if (outFileName.size() > 0)
 		{
+			BnsTool::CompressOptions options;
+			options.threadCount = threadCount;
+			options.streamOutput = streamOutput;
+			options.baseFileName = baseFileName;
+			options.cacheDirName = cacheDirName;
+			options.maxCacheSize = maxCacheSize;
+			options.compressionLevel = compressionLevel;
+			options.compressionLevelOverrides = compressionLevelOverrides;
+			options.deduplicate = deduplicate;
+			// "-" reads a tar stream from stdin
+			QFile tarInput;
+			if (inDirName == "-")
+			{
+				openStandardStream(tarInput, stdin, QIODevice::ReadOnly);
+				options.tarInput = &tarInput;
+			}
+			// compress removes a partially written output file itself
+			bool isCompressed = false;
 			if(is64)
-				BnsTool::compress64(QDir(inDirName), &QFile(outFileName));
+				isCompressed = BnsTool::compress64(QDir(inDirName), &QFile(outFileName), options);
 			else
-				BnsTool::compress(QDir(inDirName), &QFile(outFileName));
+				isCompressed = BnsTool::compress(QDir(inDirName), &QFile(outFileName), options);
+			if (!isCompressed)
+				exitCode = 1;
 		}else
 		{
 			printLine(QString("%1 is not regular dir name, you should enter a out file").arg(inDirName));
+			exitCode = 1;
+		}
+	}
+	else if ((instruction == "-p" || instruction == "-p64") && argumentList.size() >= 3)
+	{
+		XmlPatch xmlPatch;
+		if (!xmlPatch.load(argumentList.at(1)))
+			return 1;
+		const QString inFileName = argumentList.at(2);
+		QFile inFile(inFileName);
+		const bool isBinXml = inFile.open(QIODevice::ReadOnly) && inFile.peek(8) == "LMXBOSLB";
+		inFile.close();
+		const QString outFileName = (argumentList.size() >= 4) ? argumentList.at(3) : QString();
+		if (isBinXml)
+		{
+			if (!BnsTool::xmlPatchFile(inFileName, outFileName, xmlPatch))
+				exitCode = 1;
+		}
+		else
+		{
+			// without an output file the dat is patched into a temporary file that replaces it once complete
+			const bool isInPlace = outFileName.isEmpty();
+			const QString datOutFileName = isInPlace ? (inFileName + ".patching") : outFileName;
+			BnsTool::PatchOptions options;
+			options.threadCount = threadCount;
+			options.useFileMapping = !noFileMapping;
+			bool isPatched = false;
+			if (instruction.endsWith("64"))
+				isPatched = BnsTool::patch64(&QFile(inFileName), &QFile(datOutFileName), xmlPatch, options);
+			else
+				isPatched = BnsTool::patch(&QFile(inFileName), &QFile(datOutFileName), xmlPatch, options);
+			if (!isPatched)
+			{
+				exitCode = 1;
+				QFile::remove(datOutFileName);
+			}
+			else if (isInPlace && !replaceFile(datOutFileName, inFileName))
+			{
+				exitCode = 1;
+				printLine(QString("Error! replacing %1 failed, the patched file is %2").arg(inFileName).arg(datOutFileName));
+			}
+		}
+	}
+	else if ((instruction == "-d" || instruction == "-d64" || instruction == "-a" || instruction == "-a64") && argumentList.size() >= 4)
+	{
+		const bool is64 = instruction.endsWith("64");
+		BnsTool::DiffOptions options;
+		options.threadCount = threadCount;
+		options.useFileMapping = !noFileMapping;
+		// the result is written to a temporary file that only replaces the output once complete,
+		// so a failed run never leaves a delta or dat behind that looks valid
+		const QString outFileName = argumentList.at(3);
+		const QString partialFileName = outFileName + ".partial";
+		bool isSucceeded = false;
+		{
+			QFile baseFile(argumentList.at(1));
+			QFile secondFile(argumentList.at(2));
+			QFile outFile(partialFileName);
+			if (instruction.startsWith("-d"))
+			{
+				if (is64)
+					isSucceeded = BnsTool::diff64(&baseFile, &secondFile, &outFile, options);
+				else
+					isSucceeded = BnsTool::diff(&baseFile, &secondFile, &outFile, options);
+			}
+			else
+			{
+				if (is64)
+					isSucceeded = BnsTool::apply64(&baseFile, &secondFile, &outFile, options);
+				else
+					isSucceeded = BnsTool::apply(&baseFile, &secondFile, &outFile, options);
+			}
+			// the size on disk has to match once everything buffered is flushed and the file is closed
+			isSucceeded = isSucceeded && outFile.flush();
+			const qint64 writtenSize = outFile.size();
+			outFile.close();
+			isSucceeded = isSucceeded && outFile.error() == QFileDevice::NoError && writtenSize > 0
+				&& QFileInfo(partialFileName).size() == writtenSize;
+		}
+		if (!isSucceeded)
+		{
+			exitCode = 1;
+			QFile::remove(partialFileName);
+		}
+		else if (!replaceFile(partialFileName, outFileName))
+		{
+			exitCode = 1;
+			printLine(QString("Error! replacing %1 failed, the result is %2").arg(outFileName).arg(partialFileName));
 		}
 	}
 	else if (instruction == "-s")
 	{
-		const QString fileName = argumentList.at(1);
-		BnsTool::xmlAutoConvert(&QFile(fileName));
+		BnsTool::ConvertOptions options;
+		options.threadCount = threadCount;
+		if (!BnsTool::xmlAutoConvert(argumentList.mid(1), options))
+			exitCode = 1;
 	}
 	else
 	{
 		printHelp();
 	}
+
+	if (printStats)
+		Stats::print(wallTimer.nsecsElapsed());
+	if (!statsJsonFileName.isEmpty())
+	{
+		QFile statsJsonFile(statsJsonFileName);
+		if (statsJsonFile.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			statsJsonFile.write(QJsonDocument(Stats::toJson(wallTimer.nsecsElapsed())).toJson());
+		else
+			printLine(QString("Warning! file %1 open failed").arg(statsJsonFileName));
+	}
+	return exitCode;
 }